@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace AST {
+// Allocates the nodes of a parse from big blocks and frees them all at once.
+// Nodes are never destroyed one by one, so they must not own any resources.
+class Arena {
+  static constexpr size_t block_size = 64 * 1024;
+
+  vector<unique_ptr<char[]>> _blocks;
+  vector<unique_ptr<char[]>> _large_blocks;
+  char *_cursor = nullptr;
+  char *_end = nullptr;
+
+public:
+  Arena() = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  void *allocate(size_t size, size_t alignment) {
+    void *pointer = _cursor;
+    size_t space = _end - _cursor;
+
+    if (_cursor && align(alignment, size, pointer, space)) {
+      _cursor = (char *)pointer + size;
+      return pointer;
+    }
+
+    // Large allocations get a block of their own,
+    // so that the rest of the current block is not wasted
+    if (size + alignment > block_size / 4) {
+      _large_blocks.emplace_back(new char[size + alignment]);
+      pointer = _large_blocks.back().get();
+      space = size + alignment;
+      return align(alignment, size, pointer, space);
+    }
+
+    _blocks.emplace_back(new char[block_size]);
+    _cursor = _blocks.back().get();
+    _end = _cursor + block_size;
+
+    return allocate(size, alignment);
+  }
+
+  template <typename T, typename... Args> T *make(Args &&... args) {
+    static_assert(
+        is_trivially_destructible<T>::value,
+        "Arena objects are never destroyed");
+
+    return new (allocate(sizeof(T), alignof(T))) T(forward<Args>(args)...);
+  }
+
+  // Copies the elements into an array allocated from the arena.
+  template <typename T> T *make_array(const T *elements, size_t size) {
+    static_assert(
+        is_trivially_destructible<T>::value,
+        "Arena objects are never destroyed");
+
+    auto *array = (T *)allocate(sizeof(T) * size, alignof(T));
+
+    for (size_t i = 0; i < size; i++)
+      new (&array[i]) T(elements[i]);
+
+    return array;
+  }
+
+  // Exchanges the nodes of both arenas, which stay where they are.
+  void swap(Arena &other) {
+    _blocks.swap(other._blocks);
+    _large_blocks.swap(other._large_blocks);
+    std::swap(_cursor, other._cursor);
+    std::swap(_end, other._end);
+  }
+
+  // Frees every node at once. The first block is kept for the next parse.
+  void reset() {
+    _large_blocks.clear();
+
+    if (_blocks.empty())
+      return;
+
+    _blocks.resize(1);
+    _cursor = _blocks[0].get();
+    _end = _cursor + block_size;
+  }
+};
+} // namespace AST
@@ -4,7 +4,23 @@ namespace AST {
 namespace Expression {
 class Base {
 public:
-  virtual ~Base() {}
+  // The derived class of the node, to dispatch on without RTTI.
+  enum class Kind {
+    Binary,
+    Call,
+    Number,
+    Variable,
+    If,
+    For,
+  };
+
+  Kind kind() const { return _kind; }
+
+protected:
+  Base(Kind kind) : _kind(kind) {}
+
+private:
+  Kind _kind;
 };
 } // namespace Expression
 } // namespace AST
@@ -1,23 +1,20 @@
 #pragma once
 
 #include "base.cpp"
-#include <memory>
-
-using namespace std;
 
 namespace AST {
 namespace Expression {
 class Binary : public Base {
   char _op;
-  unique_ptr<Base> _lhs, _rhs;
+  Base *_lhs, *_rhs;
 
 public:
-  Binary(char Op, unique_ptr<Base> LHS, unique_ptr<Base> RHS) :
-      _op(Op), _lhs(move(LHS)), _rhs(move(RHS)) {}
+  Binary(char Op, Base *LHS, Base *RHS) :
+      Base(Kind::Binary), _op(Op), _lhs(LHS), _rhs(RHS) {}
 
   char op() const { return _op; }
-  Base *lhs() const { return _lhs.get(); }
-  Base *rhs() const { return _rhs.get(); }
+  Base *lhs() const { return _lhs; }
+  Base *rhs() const { return _rhs; }
 };
 } // namespace Expression
 } // namespace AST
@@ -1,25 +1,23 @@
 #pragma once
 
+#include "../symbol.cpp"
 #include "./base.cpp"
-#include <memory>
-#include <string>
-#include <vector>
-
-using namespace std;
 
 namespace AST {
 namespace Expression {
 class Call : public Base {
-  string _callee;
-  vector<unique_ptr<Base>> _args;
+  Symbol _callee;
+  Base **_args;
+  int _args_size;
 
 public:
-  Call(const string &Callee, vector<unique_ptr<Base>> Args)
-      : _callee(Callee), _args(move(Args)) {}
+  // The arguments array must outlive the node, e.g. be allocated in an arena.
+  Call(Symbol Callee, Base **Args, int ArgsSize)
+      : Base(Kind::Call), _callee(Callee), _args(Args), _args_size(ArgsSize) {}
 
-  string callee() const { return _callee; }
-  int args_size() const { return _args.size(); }
-  Base *arg(int index) const { return _args[index].get(); }
+  Symbol callee() const { return _callee; }
+  int args_size() const { return _args_size; }
+  Base *arg(int index) const { return _args[index]; }
 };
 } // namespace Expression
 } // namespace AST
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+
+#include "./visitor.cpp"
+
+namespace AST {
+namespace Expression {
+// Counts the nodes of an expression tree.
+class Counter : public Visitor<Counter, size_t> {
+public:
+  using Visitor::visit;
+
+  size_t visit(Binary *node) { return 1 + visit(node->lhs()) + visit(node->rhs()); }
+
+  size_t visit(Call *node) {
+    size_t count = 1;
+
+    for (int i = 0; i < node->args_size(); i++)
+      count += visit(node->arg(i));
+
+    return count;
+  }
+
+  size_t visit(Number *) { return 1; }
+  size_t visit(Variable *) { return 1; }
+
+  size_t visit(If *node) {
+    return 1 + visit(node->condition()) + visit(node->then()) + visit(node->otherwise());
+  }
+
+  size_t visit(For *node) {
+    return 1 + visit(node->start()) + visit(node->end()) +
+        (node->step() ? visit(node->step()) : 0) + visit(node->body());
+  }
+};
+} // namespace Expression
+} // namespace AST
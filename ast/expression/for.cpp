@@ -0,0 +1,34 @@
+#pragma once
+
+#include "../symbol.cpp"
+#include "./base.cpp"
+
+namespace AST {
+namespace Expression {
+// for variable = start, end, step in body
+//
+// Evaluates the body for as long as the end condition is neither 0 nor NaN,
+// adding the step to the variable after every iteration. The condition is checked before
+// the first iteration. The step is 1 if omitted. Evaluates to 0.
+class For : public Base {
+  Symbol _variable;
+  Base *_start, *_end, *_step, *_body;
+
+public:
+  // The step may be nullptr.
+  For(Symbol Variable, Base *Start, Base *End, Base *Step, Base *Body) :
+      Base(Kind::For),
+      _variable(Variable),
+      _start(Start),
+      _end(End),
+      _step(Step),
+      _body(Body) {}
+
+  Symbol variable() const { return _variable; }
+  Base *start() const { return _start; }
+  Base *end() const { return _end; }
+  Base *step() const { return _step; }
+  Base *body() const { return _body; }
+};
+} // namespace Expression
+} // namespace AST
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "./base.cpp"
+
+namespace AST {
+namespace Expression {
+// Evaluates to the then branch if the condition is neither 0 nor NaN, to the
+// else branch otherwise. Only the branch taken is evaluated.
+class If : public Base {
+  Base *_condition, *_then, *_else;
+
+public:
+  If(Base *Condition, Base *Then, Base *Else) :
+      Base(Kind::If), _condition(Condition), _then(Then), _else(Else) {}
+
+  Base *condition() const { return _condition; }
+  Base *then() const { return _then; }
+  Base *otherwise() const { return _else; }
+};
+} // namespace Expression
+} // namespace AST
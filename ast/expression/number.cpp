@@ -8,7 +8,7 @@ class Number : public Base {
   double _value;
 
 public:
-  Number(double Val) : _value(Val) {}
+  Number(double Val) : Base(Kind::Number), _value(Val) {}
   double value() const { return _value; }
 };
 } // namespace Expression
@@ -1,18 +1,16 @@
 #pragma once
 
+#include "../symbol.cpp"
 #include "./base.cpp"
-#include <string>
-
-using namespace std;
 
 namespace AST {
 namespace Expression {
 class Variable : public Base {
-  string _name;
+  Symbol _name;
 
 public:
-  Variable(const string &Name) : _name(Name) {}
-  string name() const { return _name; }
+  Variable(Symbol Name) : Base(Kind::Variable), _name(Name) {}
+  Symbol name() const { return _name; }
 };
 } // namespace Expression
 } // namespace AST
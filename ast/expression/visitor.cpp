@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdlib>
+
+#include "./base.cpp"
+#include "./binary.cpp"
+#include "./call.cpp"
+#include "./for.cpp"
+#include "./if.cpp"
+#include "./number.cpp"
+#include "./variable.cpp"
+
+namespace AST {
+namespace Expression {
+// Calls the Derived::visit() overload for the node's class, switching on its
+// kind tag. Derived classes bring visit(Base *) into scope with
+// `using Visitor::visit;`.
+template <typename Derived, typename Result> class Visitor {
+public:
+  Result visit(Base *node) {
+    auto *self = static_cast<Derived *>(this);
+
+    switch (node->kind()) {
+    case Base::Kind::Binary:
+      return self->visit(static_cast<Binary *>(node));
+    case Base::Kind::Call:
+      return self->visit(static_cast<Call *>(node));
+    case Base::Kind::Number:
+      return self->visit(static_cast<Number *>(node));
+    case Base::Kind::Variable:
+      return self->visit(static_cast<Variable *>(node));
+    case Base::Kind::If:
+      return self->visit(static_cast<If *>(node));
+    case Base::Kind::For:
+      return self->visit(static_cast<For *>(node));
+    }
+
+    abort(); // Unreachable
+  }
+};
+} // namespace Expression
+} // namespace AST
@@ -1,24 +1,18 @@
 #pragma once
 
-#include <memory>
-#include <string>
-#include <vector>
-
 #include "./expression/base.cpp"
 #include "./prototype.cpp"
 
-using namespace std;
-
 namespace AST {
 class Function {
-  unique_ptr<Prototype> _prototype;
-  unique_ptr<Expression::Base> _body;
+  Prototype *_prototype;
+  Expression::Base *_body;
 
 public:
-  Prototype *prototype() const { return _prototype.get(); }
-  Expression::Base *body() const { return _body.get(); }
+  Prototype *prototype() const { return _prototype; }
+  Expression::Base *body() const { return _body; }
 
-  Function(unique_ptr<Prototype> Proto, unique_ptr<Expression::Base> Body)
-      : _prototype(move(Proto)), _body(move(Body)) {}
+  Function(Prototype *Proto, Expression::Base *Body)
+      : _prototype(Proto), _body(Body) {}
 };
 } // namespace AST
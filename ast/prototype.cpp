@@ -1,20 +1,30 @@
 #pragma once
 
-#include <string>
-#include <vector>
-
-using namespace std;
+#include "./arena.cpp"
+#include "./symbol.cpp"
 
 namespace AST {
 class Prototype {
-  string _name;
-  vector<string> _args;
+  Symbol _name;
+  Symbol *_args;
+  int _args_size;
 
 public:
-  const string &name() const { return _name; };
-  vector<string> args() { return _args; };
+  Symbol name() const { return _name; };
+  int args_size() const { return _args_size; }
+  Symbol arg(int index) const { return _args[index]; }
+
+  // Whether it is the prototype of a top-level expression.
+  bool anonymous() const { return _name.str() == "__anon_expr"; }
+
+  // The arguments array must outlive the node, e.g. be allocated in an arena.
+  Prototype(Symbol name, Symbol *args, int args_size)
+      : _name(name), _args(args), _args_size(args_size) {}
 
-  Prototype(const string &name, vector<string> args)
-      : _name(name), _args(move(args)) {}
+  // Copies the prototype with its arguments into another arena.
+  Prototype *clone(Arena *arena) const {
+    return arena->make<Prototype>(
+        _name, arena->make_array(_args, _args_size), _args_size);
+  }
 };
 } // namespace AST
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+using namespace std;
+
+namespace AST {
+// An interned name. Every symbol with the same name points to the same
+// string, so symbols are compared and hashed as pointers.
+class Symbol {
+  const string *_name = nullptr;
+
+public:
+  Symbol() = default;
+  explicit Symbol(const string *name) : _name(name) {}
+
+  const string &str() const { return *_name; }
+
+  bool operator==(Symbol other) const { return _name == other._name; }
+  bool operator!=(Symbol other) const { return _name != other._name; }
+  bool operator<(Symbol other) const { return _name < other._name; }
+
+  size_t hash() const { return std::hash<const string *>()(_name); }
+};
+
+// Interns names into symbols. The symbols stay valid as long as the table.
+class SymbolTable {
+  unordered_map<string_view, unique_ptr<string>> _symbols;
+
+public:
+  Symbol intern(string_view name) {
+    auto symbol = _symbols.find(name);
+
+    if (symbol == _symbols.end()) {
+      auto string = make_unique<std::string>(name);
+      string_view key = *string;
+      symbol = _symbols.emplace(key, move(string)).first;
+    }
+
+    return Symbol(symbol->second.get());
+  }
+};
+} // namespace AST
+
+namespace std {
+template <> struct hash<AST::Symbol> {
+  size_t operator()(AST::Symbol symbol) const { return symbol.hash(); }
+};
+} // namespace std
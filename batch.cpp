@@ -0,0 +1,503 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include "./bounded_queue.cpp"
+#include "./codegen.cpp"
+#include "./diagnostics.cpp"
+#include "./frontend.cpp"
+#include "./jit.cpp"
+#include "./memoizer.cpp"
+#include "./optimizer.cpp"
+#include "./options.cpp"
+#include "./parser.cpp"
+#include "./purity.cpp"
+#include "./statistics.cpp"
+
+using namespace std;
+
+// Compiles a whole script into a single module, which is then either run once
+// or written to an object file. The script is parsed and compiled at once, by
+// two threads, items being handed over in order through a bounded queue.
+class Batch {
+  Parser *_parser;
+  Options _options;
+
+  // Only set if statistics are collected.
+  Statistics *_statistics;
+  Frontend _frontend;
+
+  llvm::orc::ThreadSafeContext _context;
+  unique_ptr<llvm::Module> _module;
+  unique_ptr<llvm::IRBuilder<>> _builder;
+  unique_ptr<Codegen> _codegen;
+
+  // Every definition is checked while the script is read,
+  // before any of them is generated.
+  Purity _purity;
+
+  // Names of the functions top-level expressions are compiled into, in order.
+  vector<string> _expressions;
+
+  // Only used with several jobs, which generate the functions once the whole
+  // script is read. Top-level expressions come with their index.
+  vector<pair<AST::Function *, int>> _functions;
+  vector<AST::Prototype *> _prototypes;
+
+public:
+  Batch(Parser *parser, const Options &options, Statistics *statistics = nullptr) :
+      _parser(parser),
+      _options(options),
+      _statistics(statistics),
+      _frontend(parser, statistics),
+      _context(std::make_unique<llvm::LLVMContext>()) {
+    auto &context = *_context.getContext();
+
+    _module = std::make_unique<llvm::Module>("Batch", context);
+    _builder = std::make_unique<llvm::IRBuilder<>>(context);
+    _codegen = std::make_unique<Codegen>(&context, _builder.get());
+    _codegen->set_fast_math(_options.fast_math);
+    _codegen->set_math_intrinsics(_options.math_intrinsics);
+
+    // Functions are optimized together once the whole script is read
+    _codegen->set_module(_module.get());
+
+    if (_options.memoize)
+      _codegen->set_memoization(&_purity, _options.memo_entries);
+  }
+
+  // Compile the script and either run it or write it to the output file.
+  // Returns the process exit code.
+  int run() {
+    if (!read())
+      return 1;
+
+    if (_options.output)
+      return emit_object(_options.output) ? 0 : 1;
+
+    return evaluate() ? 0 : 1;
+  }
+
+private:
+  // An item of the script, parsed by one thread and compiled by another.
+  struct Item {
+    enum class Kind { Definition, Extern, Expression, Error, End };
+
+    Kind kind = Kind::End;
+    AST::Function *function = nullptr;   // Definitions and expressions
+    AST::Prototype *prototype = nullptr; // Externs
+
+    // What the parser reported while reading the item, printed once the
+    // items before it are compiled.
+    string diagnostics;
+  };
+
+  using Queue = BoundedQueue<Item, 256>;
+
+  // Read the whole script into the module. The script is parsed on a thread
+  // of its own, while this one compiles the items already parsed, in order.
+  // Returns false if any of the items has failed.
+  bool read() {
+    Queue queue;
+    atomic<size_t> compiled{0};
+    thread parser([&]() { parse_items(queue, compiled); });
+    bool success = true;
+
+    for (auto item = queue.pop(); item.kind != Item::Kind::End; item = queue.pop()) {
+      fputs(item.diagnostics.c_str(), Diagnostics::output);
+
+      switch (item.kind) {
+      case Item::Kind::Definition:
+        success &= compile_def(item.function);
+        break;
+      case Item::Kind::Extern:
+        success &= compile_extern(item.prototype);
+        break;
+      case Item::Kind::Expression:
+        success &= compile_top_level_expression(item.function);
+        break;
+      default:
+        success = false;
+        break;
+      }
+
+      compiled.fetch_add(1, memory_order_release);
+    }
+
+    parser.join();
+    return success;
+  }
+
+  // Parse the items of the script into the queue, followed by an end.
+  //
+  // Nodes are allocated from two arenas in turn, swapped every time the queue
+  // could have been filled: by then, the other arena's items have all been
+  // popped, so it can be reset as soon as they are compiled.
+  void parse_items(Queue &queue, const atomic<size_t> &compiled) {
+    // Diagnostics are written to the items rather than printed right away
+    char *diagnostics_buffer = nullptr;
+    size_t diagnostics_size = 0;
+    auto *diagnostics = open_memstream(&diagnostics_buffer, &diagnostics_size);
+    Diagnostics::output = diagnostics;
+
+    AST::Arena other_arena;
+    size_t parsed = 0;
+    size_t swapped = 0; // The items parsed when the arenas were last swapped
+
+    _parser->lexer()->consume_token();
+
+    while (_parser->lexer()->current_token() != Lexer::Token::Eof) {
+      Item item;
+
+      switch (_parser->lexer()->current_token()) {
+      case Lexer::Token::Newline:
+        _parser->lexer()->reset();
+        _parser->lexer()->consume_token();
+        continue;
+      case ';':
+        _parser->lexer()->consume_token(); // Consume top-level semicolon
+        continue;
+      case Lexer::Token::Def:
+        item.kind = Item::Kind::Definition;
+        item.function = _frontend.parse(&Parser::parse_function_definition);
+        break;
+      case Lexer::Token::Extern:
+        item.kind = Item::Kind::Extern;
+        item.prototype = _frontend.parse(&Parser::parse_extern);
+        break;
+      default:
+        item.kind = Item::Kind::Expression;
+        item.function = _frontend.parse(&Parser::parse_top_level_expression);
+        break;
+      }
+
+      if (!item.function && !item.prototype) {
+        item.kind = Item::Kind::Error;
+
+        // That's a error, skip one token
+        _parser->lexer()->consume_token();
+      }
+
+      fflush(diagnostics);
+      item.diagnostics.assign(diagnostics_buffer, diagnostics_size);
+      rewind(diagnostics);
+
+      queue.push(move(item));
+      parsed++;
+
+      // Nodes are kept for generating the functions with several jobs
+      if (parallel() || parsed - swapped < Queue::capacity)
+        continue;
+
+      while (compiled.load(memory_order_acquire) < swapped)
+        this_thread::yield();
+
+      other_arena.reset();
+      _parser->arena()->swap(other_arena);
+      swapped = parsed;
+    }
+
+    queue.push(Item());
+
+    Diagnostics::output = stderr;
+    fclose(diagnostics);
+    free(diagnostics_buffer);
+  }
+
+  bool parallel() const { return _options.jobs > 1; }
+
+  bool compile_def(AST::Function *node) {
+    _frontend.count(node, /* definition = */ true);
+
+    if (_options.memoize)
+      _purity.check(node);
+
+    if (!parallel())
+      return _frontend.gen(*_codegen, node);
+
+    // The groups' code generators only know definitions once they are read
+    if (!_codegen->definable(node->prototype()))
+      return false;
+
+    _codegen->define(node->prototype()->name());
+    _functions.push_back({node, -1});
+    _prototypes.push_back(node->prototype());
+    return true;
+  }
+
+  bool compile_extern(AST::Prototype *node) {
+    if (!parallel())
+      return _codegen->gen(node);
+
+    _prototypes.push_back(node);
+    return true;
+  }
+
+  bool compile_top_level_expression(AST::Function *node) {
+    _frontend.count(node, /* definition = */ false);
+
+    if (parallel()) {
+      _functions.push_back({node, (int)_expressions.size()});
+      _expressions.push_back("__anon_expr." + to_string(_expressions.size()));
+      return true;
+    }
+
+    auto *function = (llvm::Function *)_frontend.gen(*_codegen, node);
+
+    if (!function)
+      return false;
+
+    // Every expression gets a function of its own
+    function->setName("__anon_expr." + to_string(_expressions.size()));
+    _expressions.push_back(function->getName());
+
+    return true;
+  }
+
+  // Run the top-level expressions in order, printing their results.
+  bool evaluate() {
+    auto jit = JIT::Create(_options, _statistics);
+
+    if (!jit)
+      return log_error(jit.takeError());
+
+    if (!(parallel() ? compile_in_parallel(**jit) : compile(**jit)))
+      return false;
+
+    for (auto &name : _expressions) {
+      auto symbol = [&]() {
+        Statistics::Timer timer(_statistics, Statistics::Phase::Materialization);
+        return (*jit)->lookup(name);
+      }();
+
+      if (!symbol)
+        return log_error(symbol.takeError());
+
+      auto *function = (double (*)())(intptr_t)symbol->getAddress();
+      double value;
+
+      {
+        Statistics::Timer timer(_statistics, Statistics::Phase::Execution);
+        value = function();
+      }
+
+      fprintf(stdout, "Evaluated to %f\n", value);
+    }
+
+    if (auto *cache = (*jit)->object_cache())
+      fprintf(
+          stderr,
+          "Object cache: %zu hit(s), %zu miss(es)\n",
+          cache->hits(),
+          cache->misses());
+
+    if (_options.memoize)
+      Memoizer::print(stderr, _purity.definitions(), [&](const string &name) {
+        return (*jit)->address_of(name);
+      });
+
+    if (_statistics)
+      (*jit)->memory_pool().print(stderr);
+
+    return true;
+  }
+
+  bool compile(JIT &jit) {
+    _module->setDataLayout(jit.data_layout());
+
+    auto target_machine = jit.create_target_machine();
+
+    if (!target_machine)
+      return log_error(target_machine.takeError());
+
+    // Only the expressions are called from outside, and the counters of the
+    // memoized functions read, so every definition may be inlined or removed
+    Optimizer optimizer(_options.level, move(*target_machine), _statistics);
+    optimizer.optimize(*_module, [](const llvm::GlobalValue &value) {
+      return value.getName().startswith("__anon_expr.") || Memoizer::counter(value);
+    });
+
+    auto key = jit.add_module(
+        llvm::orc::ThreadSafeModule(move(_module), _context),
+        /* eager = */ true);
+
+    if (!key)
+      return log_error(key.takeError());
+
+    return true;
+  }
+
+  // Generate, optimize and compile groups of functions on a pool of threads,
+  // every group in a context and module of its own. The objects are then
+  // linked into the JIT. Functions are only inlined within their group.
+  bool compile_in_parallel(JIT &jit) {
+    // A few groups per thread, so that the threads stay busy till the end
+    size_t group_size = max<size_t>(
+        1, (_functions.size() + _options.jobs * 4 - 1) / (_options.jobs * 4));
+    size_t groups = (_functions.size() + group_size - 1) / group_size;
+
+    vector<unique_ptr<llvm::MemoryBuffer>> objects(groups);
+    atomic<bool> success{true};
+
+    {
+      llvm::ThreadPool pool(_options.jobs);
+
+      for (size_t group = 0; group < groups; group++)
+        pool.async([&, group]() {
+          size_t begin = group * group_size;
+          size_t end = min(_functions.size(), begin + group_size);
+
+          if (!(objects[group] = compile_group(jit, begin, end)))
+            success = false;
+        });
+
+      pool.wait();
+    }
+
+    if (!success)
+      return false;
+
+    for (auto &object : objects)
+      if (auto error = jit.add_object(move(object)))
+        return log_error(move(error));
+
+    return true;
+  }
+
+  // Compile the functions in [begin, end) into an object.
+  unique_ptr<llvm::MemoryBuffer> compile_group(JIT &jit, size_t begin, size_t end) {
+    llvm::LLVMContext context;
+    llvm::Module module("Batch", context);
+    module.setDataLayout(jit.data_layout());
+
+    llvm::IRBuilder<> builder(context);
+    Codegen codegen(&context, &builder);
+    codegen.set_module(&module);
+    codegen.set_fast_math(_options.fast_math);
+    codegen.set_math_intrinsics(_options.math_intrinsics);
+
+    if (_options.memoize)
+      codegen.set_memoization(&_purity, _options.memo_entries);
+
+    // Functions of other groups are called by their prototypes
+    for (auto *prototype : _prototypes)
+      codegen.add_prototype(prototype);
+
+    // Every definition of the script is known, so that calls of those of
+    // other groups are not lowered to intrinsics either. Redefinitions were
+    // rejected while the script was read.
+    codegen.set_redefinable(true);
+
+    for (auto &function : _functions)
+      if (function.second < 0)
+        codegen.define(function.first->prototype()->name());
+
+    bool success = true;
+
+    for (size_t i = begin; i < end; i++) {
+      auto *function = (llvm::Function *)_frontend.gen(codegen, _functions[i].first);
+
+      if (!function)
+        success = false;
+      else if (_functions[i].second >= 0)
+        function->setName(_expressions[_functions[i].second]);
+    }
+
+    if (!success)
+      return nullptr;
+
+    auto target_machine = jit.create_target_machine();
+
+    if (!target_machine) {
+      log_error(target_machine.takeError());
+      return nullptr;
+    }
+
+    // Other groups may call any of the definitions, so none is internalized
+    Optimizer(_options.level, move(*target_machine), _statistics).optimize(module);
+
+    auto object = jit.compile_object(module);
+
+    if (!object) {
+      log_error(object.takeError());
+      return nullptr;
+    }
+
+    return move(*object);
+  }
+
+  // Compile the module into a relocatable object file, which can be linked
+  // into an executable or a shared object.
+  bool emit_object(const char *path) {
+    // The object may be linked into programs run on other machines
+    auto jtmb = JIT::detect_host(_options, _options.native);
+
+    if (!jtmb)
+      return log_error(jtmb.takeError());
+
+    jtmb->setRelocationModel(llvm::Reloc::PIC_);
+    auto target_machine = jtmb->createTargetMachine();
+
+    if (!target_machine)
+      return log_error(target_machine.takeError());
+
+    _module->setDataLayout((*target_machine)->createDataLayout());
+    _module->setTargetTriple((*target_machine)->getTargetTriple().str());
+
+    // Every definition stays callable from the code the object is linked
+    // into, so none is internalized
+    auto optimizer_target_machine = jtmb->createTargetMachine();
+
+    if (!optimizer_target_machine)
+      return log_error(optimizer_target_machine.takeError());
+
+    Optimizer(_options.level, move(*optimizer_target_machine), _statistics)
+        .optimize(*_module);
+
+    error_code error;
+    llvm::raw_fd_ostream output(path, error, llvm::sys::fs::F_None);
+
+    if (error) {
+      fprintf(stderr, "Error: cannot open %s: %s\n", path, error.message().c_str());
+      return false;
+    }
+
+    llvm::legacy::PassManager pm;
+
+    if ((*target_machine)->addPassesToEmitFile(pm, output, nullptr, llvm::TargetMachine::CGFT_ObjectFile)) {
+      fprintf(stderr, "Error: the target cannot emit object files\n");
+      return false;
+    }
+
+    {
+      Statistics::Timer timer(_statistics, Statistics::Phase::Materialization);
+      pm.run(*_module);
+    }
+
+    output.flush();
+
+    return true;
+  }
+
+  static bool log_error(llvm::Error error) {
+    llvm::logAllUnhandledErrors(move(error), llvm::errs(), "Error: ");
+    return false;
+  }
+};
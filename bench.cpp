@@ -0,0 +1,416 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include "./ast/expression/counter.cpp"
+#include "./codegen.cpp"
+#include "./jit.cpp"
+#include "./kernel.cpp"
+#include "./lexer.cpp"
+#include "./optimizer.cpp"
+#include "./options.cpp"
+#include "./parser.cpp"
+
+using namespace std;
+
+// Measures every stage of the compiler separately on generated corpora,
+// then compares evaluating a formula over rows by per-row calls and by its
+// kernel, both with strict and fast floating-point semantics, printing the
+// results as JSON.
+//
+//   bench [--iterations=N] [--scale=N] [-O0..-O3]
+class Bench {
+  using Clock = chrono::steady_clock;
+
+  // A generated source along with the function to execute.
+  struct Corpus {
+    string name;
+    string source;
+    int calls; // Calls of the entry function per execution sample
+  };
+
+  struct Phase {
+    const char *name;
+    const char *unit; // What the throughput counts
+    vector<double> seconds;
+    size_t items = 0;
+  };
+
+  int _iterations;
+  int _scale;
+  Options _options;
+
+public:
+  Bench(int iterations, int scale, const Options &options) :
+      _iterations(iterations), _scale(scale), _options(options) {}
+
+  void run() {
+    auto corpora = generate();
+
+    fprintf(
+        stdout,
+        "{\"iterations\": %d, \"scale\": %d, \"level\": %u, \"corpora\": [",
+        _iterations,
+        _scale,
+        _options.level);
+
+    for (size_t i = 0; i < corpora.size(); i++) {
+      fprintf(stdout, "%s\n  ", i ? "," : "");
+      run(corpora[i]);
+    }
+
+    fprintf(stdout, "\n], \"kernel\": {\"strict\": ");
+    run_kernel(0);
+    fprintf(stdout, ",\n  \"fast_math\": ");
+    run_kernel(Options::Fast);
+    fprintf(stdout, "}}\n");
+  }
+
+private:
+  vector<Corpus> generate() {
+    vector<Corpus> corpora;
+    string source;
+
+    // A deep chain of binary expressions
+    source = "def chain(x) x";
+    for (int i = 0; i < 100 * _scale; i++)
+      source += i % 2 ? " + x" : " * 0.5";
+    source += "\ndef bench_entry() chain(1.5)\n";
+    corpora.push_back({"deep_binary_chain", source, 1000});
+
+    // Many small definitions
+    source.clear();
+    for (int i = 0; i < 100 * _scale; i++)
+      source += "def f" + to_string(i) + "(a b) a * b + " + to_string(i) + "\n";
+    source += "def bench_entry() f0(1, 2) + f" + to_string(100 * _scale - 1) + "(3, 4)\n";
+    corpora.push_back({"many_small_defs", source, 1000});
+
+    // Calls with wide argument lists
+    int width = 32;
+    source = "def wide(";
+    for (int i = 0; i < width; i++)
+      source += (i ? " a" : "a") + to_string(i);
+    source += ") a0";
+    for (int i = 1; i < width; i++)
+      source += " + a" + to_string(i);
+    source += "\n";
+    for (int i = 0; i < 10 * _scale; i++) {
+      source += "def caller" + to_string(i) + "(x) wide(x";
+      for (int j = 1; j < width; j++)
+        source += ", x * " + to_string(j);
+      source += ")\n";
+    }
+    source += "def bench_entry() caller0(1)\n";
+    corpora.push_back({"wide_call_arguments", source, 1000});
+
+    // Recursion as deep as the corpus is scaled
+    int depth = 50 * _scale;
+    source = "def r(n) if n < 1 then 0 else r(n - 1) + 1\n";
+    source += "def bench_entry() r(" + to_string(depth) + ")\n";
+    corpora.push_back({"deep_recursion", source, 100});
+
+    return corpora;
+  }
+
+  void run(const Corpus &corpus) {
+    Phase lex{"lex", "tokens/s"};
+    Phase parse{"parse", "nodes/s"};
+    Phase dispatch{"ast_dispatch", "nodes/s"};
+    Phase codegen{"codegen", "functions/s"};
+    Phase passes{"optimization", "functions/s"};
+    Phase jit{"jit_materialization", "functions/s"};
+    Phase execute{"execution", "calls/s"};
+
+    for (int iteration = 0; iteration < _iterations; iteration++) {
+      // Lex the whole source
+      {
+        Lexer lexer(corpus.source);
+        size_t tokens = 0;
+        auto start = Clock::now();
+
+        while (lexer.consume_token() != Lexer::Token::Eof) {
+          if (lexer.current_token() == Lexer::Token::Newline)
+            lexer.reset();
+
+          tokens++;
+        }
+
+        lex.seconds.push_back(since(start));
+        lex.items = tokens;
+      }
+
+      // Parse, which includes lexing, keeping every node
+      Lexer lexer(corpus.source);
+      Parser parser(&lexer);
+      vector<AST::Function *> functions;
+      size_t nodes = 0;
+
+      {
+        auto start = Clock::now();
+        lexer.consume_token();
+
+        while (lexer.current_token() != Lexer::Token::Eof) {
+          if (lexer.current_token() == Lexer::Token::Newline) {
+            lexer.reset();
+            lexer.consume_token();
+          } else if (auto function = parser.parse_function_definition())
+            functions.push_back(function);
+          else
+            fail(corpus, "parse");
+        }
+
+        parse.seconds.push_back(since(start));
+      }
+
+      // Walk the trees, which only costs dispatching on the nodes' kinds
+      {
+        auto start = Clock::now();
+
+        for (auto *function : functions)
+          nodes += AST::Expression::Counter().visit(function->body());
+
+        dispatch.seconds.push_back(since(start));
+      }
+
+      parse.items = dispatch.items = nodes;
+
+      // Generate IR without optimizing it
+      llvm::orc::ThreadSafeContext context(std::make_unique<llvm::LLVMContext>());
+      auto module = std::make_unique<llvm::Module>("Bench", *context.getContext());
+      llvm::IRBuilder<> builder(*context.getContext());
+      Codegen generator(context.getContext(), &builder);
+      generator.set_module(module.get());
+      generator.set_math_intrinsics(_options.math_intrinsics);
+
+      {
+        auto start = Clock::now();
+
+        for (auto *function : functions)
+          if (!generator.gen(function))
+            fail(corpus, "codegen");
+
+        codegen.seconds.push_back(since(start));
+        codegen.items = functions.size();
+      }
+
+      // Compile every function
+      auto compiler = llvm::cantFail(JIT::Create(_options));
+      module->setDataLayout(compiler->data_layout());
+
+      // Optimize the whole module, keeping every function
+      {
+        Optimizer optimizer(
+            _options.level, llvm::cantFail(compiler->create_target_machine()));
+        auto start = Clock::now();
+
+        optimizer.optimize(*module);
+
+        passes.seconds.push_back(since(start));
+        passes.items = functions.size();
+      }
+
+      {
+        auto start = Clock::now();
+
+        llvm::cantFail(compiler->add_module(
+            llvm::orc::ThreadSafeModule(move(module), context)));
+
+        for (auto *function : functions)
+          llvm::cantFail(compiler->lookup(function->prototype()->name().str()));
+
+        jit.seconds.push_back(since(start));
+        jit.items = functions.size();
+      }
+
+      // Execute the entry function
+      {
+        auto symbol = llvm::cantFail(compiler->lookup("bench_entry"));
+        auto *entry = (double (*)())(intptr_t)symbol.getAddress();
+        volatile double sink = 0;
+        auto start = Clock::now();
+
+        for (int call = 0; call < corpus.calls; call++)
+          sink = sink + entry();
+
+        execute.seconds.push_back(since(start));
+        execute.items = corpus.calls;
+      }
+    }
+
+    fprintf(stdout, "{\"name\": \"%s\", \"bytes\": %zu, \"phases\": {", corpus.name.c_str(), corpus.source.size());
+
+    const Phase *phases[] = {&lex, &parse, &dispatch, &codegen, &passes, &jit, &execute};
+
+    for (size_t i = 0; i < sizeof(phases) / sizeof(*phases); i++) {
+      fprintf(stdout, "%s\n    ", i ? "," : "");
+      print(*phases[i]);
+    }
+
+    fprintf(stdout, "\n  }}");
+  }
+
+  // Evaluates a formula over columns of rows, both calling the function once
+  // per row and calling its kernel once, with the fast-math flags.
+  void run_kernel(unsigned fast_math) {
+    Corpus corpus{"kernel", "def score(a b c) a * b + c * 0.5 - a\n", 0};
+    size_t rows = 100000 * _scale;
+    Phase calls{"per_row_calls", "rows/s"};
+    Phase kernel{"kernel", "rows/s"};
+
+    Lexer lexer(corpus.source);
+    Parser parser(&lexer);
+    lexer.consume_token();
+    auto *function = parser.parse_function_definition();
+
+    if (!function)
+      fail(corpus, "parse");
+
+    llvm::orc::ThreadSafeContext context(std::make_unique<llvm::LLVMContext>());
+    auto module = std::make_unique<llvm::Module>("Bench", *context.getContext());
+    llvm::IRBuilder<> builder(*context.getContext());
+    Codegen generator(context.getContext(), &builder);
+    generator.set_module(module.get());
+    generator.set_fast_math(fast_math);
+    generator.set_math_intrinsics(_options.math_intrinsics);
+
+    auto *scalar = (llvm::Function *)generator.gen(function);
+
+    if (!scalar)
+      fail(corpus, "codegen");
+
+    Kernel::build(*scalar);
+
+    // The kernel is always optimized, as it is only worth it once vectorized
+    auto options = _options;
+    options.fast_math = fast_math;
+    auto compiler = llvm::cantFail(JIT::Create(options));
+    module->setDataLayout(compiler->data_layout());
+    Optimizer(3, llvm::cantFail(compiler->create_target_machine()))
+        .optimize(*module);
+
+    llvm::cantFail(compiler->add_module(
+        llvm::orc::ThreadSafeModule(move(module), context)));
+
+    auto *score = (double (*)(double, double, double))(intptr_t)llvm::cantFail(
+                      compiler->lookup("score"))
+                      .getAddress();
+    auto *score_kernel = (Kernel::Pointer)(intptr_t)llvm::cantFail(
+                             compiler->lookup(Kernel::name("score")))
+                             .getAddress();
+
+    vector<double> a(rows), b(rows), c(rows), out(rows);
+
+    for (size_t row = 0; row < rows; row++) {
+      a[row] = row * 0.5;
+      b[row] = 1.0 / (row + 1);
+      c[row] = row % 7;
+    }
+
+    const double *columns[] = {a.data(), b.data(), c.data()};
+
+    for (int iteration = 0; iteration < _iterations; iteration++) {
+      {
+        auto start = Clock::now();
+
+        for (size_t row = 0; row < rows; row++)
+          out[row] = score(a[row], b[row], c[row]);
+
+        calls.seconds.push_back(since(start));
+      }
+
+      {
+        auto start = Clock::now();
+        score_kernel(columns, out.data(), rows);
+        kernel.seconds.push_back(since(start));
+      }
+    }
+
+    calls.items = kernel.items = rows;
+
+    fprintf(stdout, "{\"rows\": %zu, \"phases\": {\n    ", rows);
+    print(calls);
+    fprintf(stdout, ",\n    ");
+    print(kernel);
+    fprintf(stdout, "\n  }}");
+  }
+
+  static void print(const Phase &phase) {
+    auto seconds = phase.seconds;
+    sort(seconds.begin(), seconds.end());
+
+    double median = percentile(seconds, 0.5);
+
+    fprintf(
+        stdout,
+        "\"%s\": {\"items\": %zu, \"p50_ms\": %.6f, \"p90_ms\": %.6f, "
+        "\"p99_ms\": %.6f, \"throughput\": %.1f, \"unit\": \"%s\"}",
+        phase.name,
+        phase.items,
+        median * 1e3,
+        percentile(seconds, 0.9) * 1e3,
+        percentile(seconds, 0.99) * 1e3,
+        median > 0 ? phase.items / median : 0.0,
+        phase.unit);
+  }
+
+  // The nearest-rank percentile of sorted samples.
+  static double percentile(const vector<double> &sorted, double p) {
+    if (sorted.empty())
+      return 0;
+
+    size_t rank = (size_t)ceil(p * sorted.size());
+    return sorted[rank ? rank - 1 : 0];
+  }
+
+  static double since(Clock::time_point start) {
+    return chrono::duration<double>(Clock::now() - start).count();
+  }
+
+  static void fail(const Corpus &corpus, const char *phase) {
+    fprintf(stderr, "Error: %s of %s failed\n", phase, corpus.name.c_str());
+    exit(1);
+  }
+};
+
+int main(int argc, char **argv) {
+  int iterations = 20;
+  int scale = 10;
+  Options options;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strncmp(argv[i], "--iterations=", 13))
+      iterations = atoi(argv[i] + 13);
+    else if (!strncmp(argv[i], "--scale=", 8))
+      scale = atoi(argv[i] + 8);
+    else if (!strncmp(argv[i], "-O", 2) && strlen(argv[i]) == 3 &&
+             argv[i][2] >= '0' && argv[i][2] <= '3')
+      options.level = argv[i][2] - '0';
+    else {
+      fprintf(stderr, "Error: unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  if (iterations < 1 || scale < 1) {
+    fprintf(stderr, "Error: --iterations and --scale must be positive\n");
+    return 1;
+  }
+
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  llvm::InitializeNativeTargetAsmParser();
+
+  Bench(iterations, scale, options).run();
+
+  return 0;
+}
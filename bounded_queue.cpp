@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <utility>
+
+using namespace std;
+
+// A queue of at most Capacity items, which one thread pushes into and another
+// one pops from, in order, without locks. Each thread only writes its own
+// index, and publishes an item, or a free slot, by releasing it. A thread
+// waits for a slot or for an item by yielding.
+template <typename T, size_t Capacity> class BoundedQueue {
+  static_assert(
+      Capacity >= 2 && !(Capacity & (Capacity - 1)),
+      "The capacity must be a power of two");
+
+  T _items[Capacity];
+
+  // Counts of the items popped and pushed so far, each on a cache line of
+  // its own, as the threads write them.
+  alignas(64) atomic<size_t> _head{0};
+  alignas(64) atomic<size_t> _tail{0};
+
+public:
+  static constexpr size_t capacity = Capacity;
+
+  // Only called by the producing thread.
+  void push(T item) {
+    auto tail = _tail.load(memory_order_relaxed);
+
+    while (tail - _head.load(memory_order_acquire) == Capacity)
+      this_thread::yield();
+
+    _items[tail & (Capacity - 1)] = move(item);
+    _tail.store(tail + 1, memory_order_release);
+  }
+
+  // Only called by the consuming thread.
+  T pop() {
+    auto head = _head.load(memory_order_relaxed);
+
+    while (_tail.load(memory_order_acquire) == head)
+      this_thread::yield();
+
+    T item = move(_items[head & (Capacity - 1)]);
+    _head.store(head + 1, memory_order_release);
+
+    return item;
+  }
+};
@@ -1,62 +1,170 @@
 #pragma once
 
 #include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Operator.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Verifier.h"
 
+#include "./ast/arena.cpp"
 #include "./ast/expression/binary.cpp"
 #include "./ast/expression/call.cpp"
+#include "./ast/expression/for.cpp"
+#include "./ast/expression/if.cpp"
 #include "./ast/expression/number.cpp"
 #include "./ast/expression/variable.cpp"
+#include "./ast/expression/visitor.cpp"
 #include "./ast/function.cpp"
+#include "./ast/symbol.cpp"
+#include "./diagnostics.cpp"
+#include "./memoizer.cpp"
+#include "./options.cpp"
+#include "./purity.cpp"
 
 using namespace std;
 
-class Codegen {
+class Codegen : public AST::Expression::Visitor<Codegen, llvm::Value *> {
   llvm::LLVMContext *_context;
   llvm::Module *_module;
   llvm::IRBuilder<> *_builder;
-  llvm::legacy::FunctionPassManager *_fpm;
 
-  map<string, llvm::Value *> _named_values;
+  unordered_map<AST::Symbol, llvm::Value *> _named_values;
+
+  // Every prototype seen so far, so that functions defined in earlier modules
+  // can be declared again in the current one. The prototypes are copied into
+  // an arena of their own, as the parser's one is reset after every item.
+  unordered_map<AST::Symbol, AST::Prototype *> _prototypes;
+  AST::Arena _prototypes_arena;
+
+  // Only set if pure functions are memoized, with tables of that many entries.
+  const Purity *_purity = nullptr;
+  uint64_t _memo_entries = 0;
+
+  // The functions defined so far, in any module. Unless functions are
+  // redefinable, they are only defined once.
+  unordered_set<AST::Symbol> _definitions;
+  bool _redefinable = false;
+
+  // Whether calls of known math externs are lowered to intrinsics, unless
+  // a function of the same name has been defined.
+  bool _math_intrinsics = false;
+
+  struct MathIntrinsic {
+    llvm::Intrinsic::ID id;
+    unsigned arity;
+  };
+
+  // The C library functions with an intrinsic of the same semantics.
+  inline static const unordered_map<string, MathIntrinsic> _math = {
+      {"sqrt", {llvm::Intrinsic::sqrt, 1}},
+      {"sin", {llvm::Intrinsic::sin, 1}},
+      {"cos", {llvm::Intrinsic::cos, 1}},
+      {"exp", {llvm::Intrinsic::exp, 1}},
+      {"exp2", {llvm::Intrinsic::exp2, 1}},
+      {"log", {llvm::Intrinsic::log, 1}},
+      {"log2", {llvm::Intrinsic::log2, 1}},
+      {"log10", {llvm::Intrinsic::log10, 1}},
+      {"pow", {llvm::Intrinsic::pow, 2}},
+      {"fabs", {llvm::Intrinsic::fabs, 1}},
+      {"floor", {llvm::Intrinsic::floor, 1}},
+      {"ceil", {llvm::Intrinsic::ceil, 1}},
+      {"trunc", {llvm::Intrinsic::trunc, 1}},
+      {"round", {llvm::Intrinsic::round, 1}},
+      {"rint", {llvm::Intrinsic::rint, 1}},
+      {"nearbyint", {llvm::Intrinsic::nearbyint, 1}},
+      {"fmin", {llvm::Intrinsic::minnum, 2}},
+      {"fmax", {llvm::Intrinsic::maxnum, 2}},
+      {"copysign", {llvm::Intrinsic::copysign, 2}},
+      {"fma", {llvm::Intrinsic::fma, 3}}};
 
 public:
   static llvm::Value *log_error(const char *string) {
-    fprintf(stderr, "Codegen error: %s\n", string);
+    fprintf(Diagnostics::output, "Codegen error: %s\n", string);
     return nullptr;
   }
 
-  Codegen(llvm::LLVMContext *context, llvm::Module *module, llvm::IRBuilder<> *builder, llvm::legacy::FunctionPassManager *fpm)
-      : _context(context), _module(module), _builder(builder), _fpm(fpm) {}
+  Codegen(llvm::LLVMContext *context, llvm::IRBuilder<> *builder)
+      : _context(context), _module(nullptr), _builder(builder) {}
 
-  // Generate base expression IR.
-  // It automatically determines which derived type the expression node is.
-  llvm::Value *gen(AST::Expression::Base *node) {
-    if (auto binary = dynamic_cast<AST::Expression::Binary *>(node))
-      return gen(binary);
-    else if (auto call = dynamic_cast<AST::Expression::Call *>(node))
-      return gen(call);
-    else if (auto number = dynamic_cast<AST::Expression::Number *>(node))
-      return gen(number);
-    else if (auto variable = dynamic_cast<AST::Expression::Variable *>(node))
-      return gen(variable);
-    else
-      return (llvm::Value *)log_error("Unrecognized expression node type");
+  Codegen(const Codegen &) = delete;
+
+  // Set the module to generate IR into. Functions are left unoptimized,
+  // for the whole module to be optimized at once.
+  void set_module(llvm::Module *module) { _module = module; }
+
+  // Memoize the definitions the purity has found to be pure, which must be
+  // checked before they are generated.
+  void set_memoization(const Purity *purity, uint64_t entries) {
+    _purity = purity;
+    _memo_entries = entries;
+  }
+
+  // Trade strict IEEE semantics for speed, with the Options::FastMath flags,
+  // on every floating-point operation generated from now on.
+  void set_fast_math(unsigned flags) {
+    llvm::FastMathFlags fast_math;
+
+    if (flags == Options::Fast)
+      fast_math.setFast();
+    else {
+      fast_math.setAllowReassoc(flags & Options::Reassociate);
+      fast_math.setAllowContract(flags & Options::Contract);
+      fast_math.setNoNaNs(flags & Options::NoNaNs);
+      fast_math.setNoInfs(flags & Options::NoInfs);
+      fast_math.setNoSignedZeros(flags & Options::NoSignedZeros);
+      fast_math.setApproxFunc(flags & Options::ApproximateFunctions);
+    }
+
+    _builder->setFastMathFlags(fast_math);
+  }
+
+  // Let functions be defined again, e.g. in later modules of the JIT.
+  void set_redefinable(bool redefinable) { _redefinable = redefinable; }
+
+  // Whether the function may be defined: either it has not been yet, or
+  // functions are redefinable, as are top-level expressions. Logs an error
+  // if not.
+  bool definable(AST::Prototype *node) {
+    if (_redefinable || node->anonymous() || !_definitions.count(node->name()))
+      return true;
+
+    log_error("Function cannot be redefined");
+    return false;
   }
 
+  // Know the function is defined, e.g. by another module, so that calls of
+  // it are not lowered to intrinsics.
+  void define(AST::Symbol name) { _definitions.insert(name); }
+
+  // Forget the function was defined, e.g. once its module is removed.
+  void undefine(AST::Symbol name) { _definitions.erase(name); }
+
+  // Lower calls of math externs, e.g. sin or sqrt, to LLVM intrinsics, which
+  // the optimizer can constant fold, hoist out of loops and vectorize.
+  // Intrinsics left are compiled into calls of the same C functions.
+  void set_math_intrinsics(bool enabled) { _math_intrinsics = enabled; }
+
+  using Visitor::visit;
+
+  // Generate base expression IR.
+  // The node's kind tag determines which derived type the node is.
+  llvm::Value *gen(AST::Expression::Base *node) { return visit(node); }
+
   // Generate number literal IR.
-  llvm::Value *gen(AST::Expression::Number *node) {
+  llvm::Value *visit(AST::Expression::Number *node) {
     return llvm::ConstantFP::get(*_context, llvm::APFloat(node->value()));
   }
 
   // Generate variable IR.
-  llvm::Value *gen(AST::Expression::Variable *node) {
+  llvm::Value *visit(AST::Expression::Variable *node) {
     // Lookup the value by name in the current scope
     llvm::Value *value = _named_values[node->name()];
 
@@ -67,8 +175,11 @@ public:
   }
 
   // Generate call IR.
-  llvm::Value *gen(AST::Expression::Call *node) {
-    llvm::Function *callee = _module->getFunction(node->callee());
+  llvm::Value *visit(AST::Expression::Call *node) {
+    llvm::Function *callee = get_function(node->callee());
+
+    if (callee && _math_intrinsics && !_definitions.count(node->callee()))
+      callee = math_intrinsic(callee);
 
     if (!callee)
       return (llvm::Value *)log_error("Unknown function referenced");
@@ -89,7 +200,7 @@ public:
   }
 
   // Generate binary expression IR.
-  llvm::Value *gen(AST::Expression::Binary *node) {
+  llvm::Value *visit(AST::Expression::Binary *node) {
     llvm::Value *lhs = gen(node->lhs());
     llvm::Value *rhs = gen(node->rhs());
     llvm::Value *result;
@@ -114,50 +225,241 @@ public:
     }
   }
 
+  // Generate if expression IR, merging the values of the branches with a phi.
+  llvm::Value *visit(AST::Expression::If *node) {
+    llvm::Value *condition = gen(node->condition());
+
+    if (!condition)
+      return nullptr;
+
+    llvm::Function *function = _builder->GetInsertBlock()->getParent();
+    llvm::BasicBlock *then_block = llvm::BasicBlock::Create(*_context, "then", function);
+    llvm::BasicBlock *else_block = llvm::BasicBlock::Create(*_context, "else", function);
+    llvm::BasicBlock *merge_block = llvm::BasicBlock::Create(*_context, "ifcont", function);
+
+    _builder->CreateCondBr(truth(condition, "ifcond"), then_block, else_block);
+
+    // Generating a branch may add blocks, so the phi's incoming blocks
+    // are the ones the branches end in
+    _builder->SetInsertPoint(then_block);
+    llvm::Value *then_value = gen(node->then());
+
+    if (!then_value)
+      return nullptr;
+
+    _builder->CreateBr(merge_block);
+    then_block = _builder->GetInsertBlock();
+
+    _builder->SetInsertPoint(else_block);
+    llvm::Value *else_value = gen(node->otherwise());
+
+    if (!else_value)
+      return nullptr;
+
+    _builder->CreateBr(merge_block);
+    else_block = _builder->GetInsertBlock();
+
+    _builder->SetInsertPoint(merge_block);
+    llvm::PHINode *phi = _builder->CreatePHI(llvm::Type::getDoubleTy(*_context), 2, "iftmp");
+    phi->addIncoming(then_value, then_block);
+    phi->addIncoming(else_value, else_block);
+
+    return phi;
+  }
+
+  // Generate for expression IR. The condition is checked in the loop header,
+  // before the body, and the variable is a phi of the header, so that the
+  // loop passes see a canonical loop: LICM, unrolling and vectorization.
+  llvm::Value *visit(AST::Expression::For *node) {
+    llvm::Value *start = gen(node->start());
+
+    if (!start)
+      return nullptr;
+
+    llvm::Function *function = _builder->GetInsertBlock()->getParent();
+    llvm::BasicBlock *preheader = _builder->GetInsertBlock();
+    llvm::BasicBlock *header = llvm::BasicBlock::Create(*_context, "loop", function);
+    llvm::BasicBlock *body = llvm::BasicBlock::Create(*_context, "body", function);
+    llvm::BasicBlock *after = llvm::BasicBlock::Create(*_context, "afterloop", function);
+
+    _builder->CreateBr(header);
+    _builder->SetInsertPoint(header);
+
+    llvm::PHINode *variable = _builder->CreatePHI(
+        llvm::Type::getDoubleTy(*_context), 2, node->variable().str());
+    variable->addIncoming(start, preheader);
+
+    // The variable shadows an argument of the same name within the loop
+    auto shadowed = _named_values.find(node->variable());
+    llvm::Value *shadowed_value = shadowed != _named_values.end() ? shadowed->second : nullptr;
+    _named_values[node->variable()] = variable;
+
+    llvm::Value *end = gen(node->end());
+
+    if (!end)
+      return nullptr;
+
+    _builder->CreateCondBr(truth(end, "loopcond"), body, after);
+    _builder->SetInsertPoint(body);
+
+    // The body's value is discarded
+    if (!gen(node->body()))
+      return nullptr;
+
+    llvm::Value *step = node->step() ? gen(node->step())
+                                     : llvm::ConstantFP::get(*_context, llvm::APFloat(1.0));
+
+    if (!step)
+      return nullptr;
+
+    llvm::Value *next = _builder->CreateFAdd(variable, step, "nextvar");
+    variable->addIncoming(next, _builder->GetInsertBlock());
+    _builder->CreateBr(header);
+
+    _builder->SetInsertPoint(after);
+
+    if (shadowed_value)
+      _named_values[node->variable()] = shadowed_value;
+    else
+      _named_values.erase(node->variable());
+
+    return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*_context));
+  }
+
   // Generate function IR.
   llvm::Value *gen(AST::Function *node) {
+    if (!definable(node->prototype()))
+      return nullptr;
+
     llvm::Function *function = (llvm::Function *)gen(node->prototype());
 
     if (!function)
       return nullptr;
 
+    // Before the body is generated, which may call the function itself
+    bool defined = node->prototype()->anonymous() ||
+        !_definitions.insert(node->prototype()->name()).second;
+
     // The entry block
     llvm::BasicBlock *basic_block = llvm::BasicBlock::Create(*_context, "entry", function);
     _builder->SetInsertPoint(basic_block);
 
     _named_values.clear();
     for (auto &arg : function->args())
-      _named_values[arg.getName()] = &arg;
+      _named_values[node->prototype()->arg(arg.getArgNo())] = &arg;
 
     if (llvm::Value *return_value = gen(node->body())) {
       _builder->CreateRet(return_value);
 
       llvm::verifyFunction(*function);
-      _fpm->run(*function);
+
+      if (_purity && _purity->pure(node->prototype()->name()))
+        Memoizer::wrap(*function, _memo_entries);
 
       return function;
     }
 
-    function->eraseFromParent();
+    if (!defined)
+      _definitions.erase(node->prototype()->name());
+
+    // Keep the declaration if other functions already call it
+    if (function->use_empty())
+      function->eraseFromParent();
+    else
+      function->deleteBody();
+
     return nullptr;
   }
 
   // Generate function prototype IR. In the LLVM world it really means "llvm::Function without body".
   llvm::Value *gen(AST::Prototype *node) {
-    llvm::Function *function = _module->getFunction(node->name());
+    llvm::Function *function = _module->getFunction(node->name().str());
 
-    if (function)
+    if (function && !function->isDeclaration())
       return log_error("Function cannot be redefined");
 
-    vector<llvm::Type *> doubles(node->args().size(), llvm::Type::getDoubleTy(*_context));
+    if (function && function->arg_size() != (size_t)node->args_size())
+      return log_error("Function redeclared with a different number of arguments");
+
+    // Functions of earlier modules are called with the arguments they were
+    // declared with, even if they are defined again
+    auto *known = prototype(node->name());
+
+    if (known && known->args_size() != node->args_size())
+      return log_error("Function redeclared with a different number of arguments");
+
+    add_prototype(node);
+
+    // Calls may have declared the function before its definition
+    if (function) {
+      for (auto &arg : function->args())
+        arg.setName(node->arg(arg.getArgNo()).str());
+
+      return function;
+    }
+
+    return declare(node);
+  }
+
+  // Make the prototype known without declaring it in the current module,
+  // e.g. for a function defined in another module. Top-level expressions
+  // are never called, so their prototypes are not kept, which would grow
+  // the arena with every expression.
+  void add_prototype(AST::Prototype *node) {
+    if (!node->anonymous())
+      _prototypes[node->name()] = node->clone(&_prototypes_arena);
+  }
+
+  // Return the prototype seen for the name, or nullptr if there is none.
+  AST::Prototype *prototype(AST::Symbol name) const {
+    auto prototype = _prototypes.find(name);
+    return prototype == _prototypes.end() ? nullptr : prototype->second;
+  }
+
+private:
+  // Return the intrinsic the function is lowered to,
+  // or the function itself if it is not a known math function.
+  llvm::Function *math_intrinsic(llvm::Function *function) {
+    auto math = _math.find(function->getName().str());
+
+    if (math == _math.end() || math->second.arity != function->arg_size())
+      return function;
+
+    return llvm::Intrinsic::getDeclaration(
+        _module, math->second.id, {llvm::Type::getDoubleTy(*_context)});
+  }
+
+  // Convert a double to a bool, true unless it is 0 or NaN.
+  llvm::Value *truth(llvm::Value *value, const char *name) {
+    return _builder->CreateFCmpONE(
+        value, llvm::ConstantFP::get(*_context, llvm::APFloat(0.0)), name);
+  }
+
+  // Return the function from the current module,
+  // declaring it first if it was seen in an earlier module.
+  llvm::Function *get_function(AST::Symbol name) {
+    if (auto *function = _module->getFunction(name.str()))
+      return function;
+
+    auto prototype = _prototypes.find(name);
+
+    if (prototype != _prototypes.end())
+      return declare(prototype->second);
+
+    return nullptr;
+  }
+
+  // Declare the prototype in the current module.
+  llvm::Function *declare(AST::Prototype *node) {
+    vector<llvm::Type *> doubles(node->args_size(), llvm::Type::getDoubleTy(*_context));
 
     llvm::FunctionType *prototype = llvm::FunctionType::get(llvm::Type::getDoubleTy(*_context), doubles, false);
-    function = llvm::Function::Create(prototype, llvm::Function::ExternalLinkage, node->name(), _module);
+    llvm::Function *function = llvm::Function::Create(prototype, llvm::Function::ExternalLinkage, node->name().str(), _module);
 
     unsigned idx = 0;
 
     for (auto &arg : function->args())
-      arg.setName(node->args()[idx++]);
+      arg.setName(node->arg(idx++).str());
 
     return function;
   }
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstdio>
+
+namespace Diagnostics {
+// The stream errors are reported to. Every thread has its own,
+// so that e.g. the sessions of a server report to their own clients.
+inline thread_local FILE *output = stderr;
+} // namespace Diagnostics
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "llvm/IR/Value.h"
+
+#include "./ast/expression/counter.cpp"
+#include "./ast/function.cpp"
+#include "./codegen.cpp"
+#include "./parser.cpp"
+#include "./statistics.cpp"
+
+using namespace std;
+
+// Parses items and generates their IR, timing and counting both in the
+// statistics, if collected. Shared by the REPL and the batch mode.
+class Frontend {
+  Parser *_parser;
+
+  // Only set if statistics are collected.
+  Statistics *_statistics;
+
+public:
+  Frontend(Parser *parser, Statistics *statistics = nullptr) :
+      _parser(parser), _statistics(statistics) {}
+
+  // Parses the next item with the parser's method.
+  template <typename Node> Node *parse(Node *(Parser::*method)()) {
+    Statistics::Timer timer(_statistics, Statistics::Phase::Parse);
+    return (_parser->*method)();
+  }
+
+  // Counts the nodes of the item's body, and the function if it is defined.
+  void count(AST::Function *node, bool definition) {
+    if (!_statistics)
+      return;
+
+    if (definition)
+      _statistics->add(Statistics::Counter::Functions, 1);
+
+    _statistics->add(
+        Statistics::Counter::Nodes, AST::Expression::Counter().visit(node->body()));
+  }
+
+  llvm::Value *gen(Codegen &codegen, AST::Function *node) {
+    Statistics::Timer timer(_statistics, Statistics::Phase::Codegen);
+    return codegen.gen(node);
+  }
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <memory>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+using namespace std;
+
+// Keeps the IR of small functions from earlier modules, so that the optimizer
+// can inline them into later ones. The REPL compiles every definition in a
+// module of its own, so the inliner would never see a callee's body otherwise.
+//
+// Bodies are imported as available_externally definitions: they may be
+// inlined, but the code called is still the one compiled with the defining
+// module.
+class InlineLibrary {
+  unique_ptr<llvm::Module> _module;
+
+  // Functions with more instructions are not kept.
+  unsigned _threshold;
+
+public:
+  InlineLibrary(llvm::LLVMContext &context, unsigned threshold = 64) :
+      _module(std::make_unique<llvm::Module>("InlineLibrary", context)),
+      _threshold(threshold) {}
+
+  // Keep the small functions the optimized module defines.
+  void add(const llvm::Module &module) {
+    for (auto &function : module) {
+      if (function.isDeclaration() || function.hasLocalLinkage() ||
+          function.hasAvailableExternallyLinkage() ||
+          function.hasFnAttribute(llvm::Attribute::NoInline))
+        continue;
+
+      if (size(function) > _threshold)
+        continue;
+
+      auto *copy = declaration(function, *_module);
+      copy->deleteBody();
+      copy_body(function, copy);
+    }
+  }
+
+  // Give the functions the module calls their bodies from the library,
+  // along with the bodies of the functions those call.
+  void import_into(llvm::Module &module) {
+    // Declarations copied bodies need are appended to the list,
+    // and so visited by this very loop
+    for (auto &function : module) {
+      if (!function.isDeclaration() || function.isIntrinsic())
+        continue;
+
+      auto *source = _module->getFunction(function.getName());
+
+      if (!source || source->isDeclaration())
+        continue;
+
+      copy_body(*source, &function);
+      function.setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+    }
+  }
+
+  // Turn the imported bodies the optimizer did not remove back into
+  // declarations, as they are compiled with the modules defining them.
+  static void strip(llvm::Module &module) {
+    for (auto &function : module)
+      if (function.hasAvailableExternallyLinkage())
+        function.deleteBody();
+  }
+
+private:
+  static unsigned size(const llvm::Function &function) {
+    unsigned instructions = 0;
+
+    for (auto &block : function)
+      instructions += block.size();
+
+    return instructions;
+  }
+
+  // Returns the function of the module with the same name and type,
+  // declaring it if there is none.
+  static llvm::Function *
+  declaration(const llvm::Function &function, llvm::Module &module) {
+    if (auto *existing = module.getFunction(function.getName()))
+      return existing;
+
+    return llvm::Function::Create(
+        function.getFunctionType(),
+        llvm::Function::ExternalLinkage,
+        function.getName(),
+        &module);
+  }
+
+  // Copy the source's body into the destination declaration.
+  // Functions the body calls are declared in the destination's module.
+  static void copy_body(const llvm::Function &source, llvm::Function *destination) {
+    llvm::ValueToValueMapTy map;
+    auto argument = destination->arg_begin();
+
+    for (auto &arg : source.args()) {
+      argument->setName(arg.getName());
+      map[&arg] = &*argument++;
+    }
+
+    for (auto &block : source)
+      for (auto &instruction : block)
+        if (auto *call = llvm::dyn_cast<llvm::CallInst>(&instruction))
+          if (auto *callee = call->getCalledFunction())
+            map[callee] = declaration(*callee, *destination->getParent());
+
+    llvm::SmallVector<llvm::ReturnInst *, 4> returns;
+    llvm::CloneFunctionInto(
+        destination, &source, map, /* ModuleLevelChanges = */ true, returns);
+  }
+};
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <vector>
+
+#include "./ast/expression/binary.cpp"
+#include "./ast/expression/call.cpp"
+#include "./ast/expression/number.cpp"
+#include "./ast/expression/variable.cpp"
+#include "./ast/expression/visitor.cpp"
+#include "./ast/symbol.cpp"
+#include "./native.cpp"
+
+using namespace std;
+
+// Evaluates small expressions on the AST, calling compiled functions by their
+// addresses. Compiling an expression which only runs once takes milliseconds,
+// while interpreting a small one takes nanoseconds.
+//
+// An expression is checked as a whole before any of it runs, so that one
+// which cannot be interpreted is left to the JIT without side effects.
+class Interpreter : public AST::Expression::Visitor<Interpreter, double> {
+public:
+  // Returns the address of the compiled function with the name and number of
+  // arguments, or 0 if there is none.
+  using Resolver = function<uint64_t(AST::Symbol name, int args_size)>;
+
+private:
+  // Checks that an expression can be interpreted, resolving the callees
+  // in the order the interpreter visits the calls.
+  class Checker : public AST::Expression::Visitor<Checker, bool> {
+    Interpreter *_interpreter;
+    size_t _nodes = 0;
+
+  public:
+    Checker(Interpreter *interpreter) : _interpreter(interpreter) {}
+
+    using Visitor::visit;
+
+    bool visit(AST::Expression::Binary *node) {
+      switch (node->op()) {
+      case '+':
+      case '-':
+      case '*':
+      case '<':
+        return count() && visit(node->lhs()) && visit(node->rhs());
+      default:
+        return false;
+      }
+    }
+
+    bool visit(AST::Expression::Call *node) {
+      if (!count() || node->args_size() > Native::max_args)
+        return false;
+
+      auto address = _interpreter->_resolver(node->callee(), node->args_size());
+
+      if (!address)
+        return false;
+
+      _interpreter->_callees.push_back(address);
+
+      for (int i = 0; i < node->args_size(); i++)
+        if (!visit(node->arg(i)))
+          return false;
+
+      return true;
+    }
+
+    bool visit(AST::Expression::Number *) { return count(); }
+
+    // Top-level expressions have no variables
+    bool visit(AST::Expression::Variable *) { return false; }
+
+    // Control flow is left to the JIT, as the callees are resolved in the
+    // order of the calls, whichever branch would be taken
+    bool visit(AST::Expression::If *) { return false; }
+    bool visit(AST::Expression::For *) { return false; }
+
+  private:
+    bool count() { return ++_nodes <= _interpreter->_limit; }
+  };
+
+  Resolver _resolver;
+
+  // Expressions with more nodes are left to the JIT.
+  size_t _limit;
+
+  // The addresses of the functions called, in the order of the calls.
+  vector<uint64_t> _callees;
+  size_t _next_callee = 0;
+
+public:
+  Interpreter(Resolver resolver, size_t limit) :
+      _resolver(move(resolver)), _limit(limit) {}
+
+  // Evaluates the expression, or returns nothing without running any of it
+  // if it cannot be interpreted, e.g. is too large or calls an unknown
+  // function. It should be compiled then, which also reports any errors.
+  optional<double> evaluate(AST::Expression::Base *node) {
+    _callees.clear();
+    _next_callee = 0;
+
+    if (!Checker(this).visit(node))
+      return nullopt;
+
+    return visit(node);
+  }
+
+  using Visitor::visit;
+
+  double visit(AST::Expression::Number *node) { return node->value(); }
+
+  // Rejected when checked
+  double visit(AST::Expression::Variable *) { return 0; }
+  double visit(AST::Expression::If *) { return 0; }
+  double visit(AST::Expression::For *) { return 0; }
+
+  double visit(AST::Expression::Binary *node) {
+    double lhs = visit(node->lhs());
+    double rhs = visit(node->rhs());
+
+    switch (node->op()) {
+    case '+':
+      return lhs + rhs;
+    case '-':
+      return lhs - rhs;
+    case '*':
+      return lhs * rhs;
+    default:
+      // Unordered, as the compiled comparison: true if either is NaN
+      return !(lhs >= rhs) ? 1.0 : 0.0;
+    }
+  }
+
+  double visit(AST::Expression::Call *node) {
+    auto address = _callees[_next_callee++];
+    double args[Native::max_args];
+
+    // Arguments are evaluated in order, as in compiled code
+    for (int i = 0; i < node->args_size(); i++)
+      args[i] = visit(node->arg(i));
+
+    return Native::call(address, args, node->args_size());
+  }
+};
@@ -1,20 +1,90 @@
 #pragma once
 
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
-#include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/Support/Error.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetOptions.h"
 
+#include <atomic>
+#include <cstdio>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "./diagnostics.cpp"
+#include "./memory_pool.cpp"
+#include "./object_cache.cpp"
+#include "./optimizer.cpp"
+#include "./options.cpp"
+#include "./perf_map.cpp"
+#include "./statistics.cpp"
 
 using namespace std;
 
 class JIT {
+  // A module added to the JIT, remembered so that it can be removed later.
+  struct Module {
+    llvm::orc::JITDylib *dylib = nullptr;
+    llvm::orc::SymbolNameSet symbols;
+
+    // The objects the module was compiled into: a single one, or in the lazy
+    // mode one per partition compiled so far. Only those loaded by the event
+    // listeners have keys.
+    vector<PooledMemoryManager *> memory_managers;
+    vector<llvm::JITEventListener::ObjectKey> objects;
+
+    // In the tiered mode, the modules its hot functions were recompiled
+    // into, which are removed along with it.
+    vector<llvm::orc::VModuleKey> recompiled;
+  };
+
+  // A function compiled by the baseline tier, which counts its calls until
+  // it is hot enough to be recompiled at full optimization.
+  struct TieredFunction {
+    JIT *jit;
+    string name;
+
+    // The module the function was defined in, by its key, and as bitcode
+    // from before it was instrumented.
+    llvm::orc::VModuleKey module;
+    shared_ptr<const string> bitcode;
+
+    // Incremented by the baseline code. Lost updates only delay promotion.
+    uint64_t calls = 0;
+    atomic<bool> promoted{false};
+
+    TieredFunction(
+        JIT *jit,
+        string name,
+        llvm::orc::VModuleKey module,
+        shared_ptr<const string> bitcode) :
+        jit(jit), name(move(name)), module(module), bitcode(move(bitcode)) {}
+  };
+
+  // The memory of every module's code and data. Declared first, so that it
+  // outlives the memory managers of the object layer.
+  MemoryPool _memory_pool;
+
   // Provides context for our running JIT’d code.
   // This includes the string pool, global mutex,
   // and error reporting facilities.
@@ -23,10 +93,65 @@ class JIT {
   // Used to add object files to the JIT.
   llvm::orc::RTDyldObjectLinkingLayer _object_layer;
 
+  // The target to compile for.
+  llvm::orc::JITTargetMachineBuilder _jtmb;
+  llvm::Triple _triple;
+
+  // Compiles modules from IR to object files.
+  llvm::orc::ConcurrentIRCompiler _compiler;
+
   // Used to add LLVM Modules to the JIT
   // and which builds on the _objectLayer.
   llvm::orc::IRCompileLayer _ir_compile_layer;
 
+  // Only set in the lazy mode. Builds a call-through stub for every function
+  // of an added module, compiling the function's body on its first call.
+  unique_ptr<llvm::orc::LazyCallThroughManager> _lazy_call_through_manager;
+  unique_ptr<llvm::orc::CompileOnDemandLayer> _compile_on_demand_layer;
+
+  // Only set in the tiered and the redefinable modes, where functions are
+  // called through stubs.
+  //
+  // In the tiered mode the stubs point to the baseline code first and to the
+  // optimized code once the function is hot. The baseline code is compiled by
+  // a layer of its own, bypassing the object cache: it embeds addresses valid
+  // in this process only.
+  unique_ptr<llvm::orc::IndirectStubsManager> _stubs_manager;
+  unique_ptr<llvm::orc::IRCompileLayer> _baseline_compile_layer;
+  uint64_t _hot_threshold = 0;
+
+  // Functions compiled by the baseline tier, which the code refers to.
+  vector<unique_ptr<TieredFunction>> _tiered_functions;
+
+  // The number of hot functions recompiled so far.
+  atomic<size_t> _promoted_functions{0};
+
+  // In the redefinable mode the stubs point to the latest definitions. Every
+  // definition is renamed with a version suffix, so that its code can be
+  // replaced without recompiling its callers, which call the stub.
+  bool _redefinable = false;
+  uint64_t _version = 0;
+
+  // The module defining the latest version of every function, and the number
+  // of functions every such module still defines the latest version of.
+  // A module is removed once it defines none.
+  map<string, llvm::orc::VModuleKey> _latest_modules;
+  map<llvm::orc::VModuleKey, size_t> _latest_definitions;
+
+  // The functions given a stub, which stays even if no version of the
+  // function could be compiled, then calling baseline_missing().
+  set<string> _stubbed;
+
+  // Only set if objects are cached. Objects found in the cache are loaded
+  // without compiling their modules.
+  unique_ptr<ObjectCache> _object_cache;
+
+  // Only set if statistics are collected.
+  Statistics *_statistics = nullptr;
+
+  // The number of function bodies compiled so far.
+  atomic<size_t> _materialized_functions{0};
+
   // Used for symbol mangling.
   llvm::DataLayout _data_layout;
 
@@ -36,10 +161,33 @@ class JIT {
   // The LLVM context.
   llvm::orc::ThreadSafeContext _context;
 
+  // Modules which may be removed, by their keys.
+  map<llvm::orc::VModuleKey, Module> _modules;
+  mutex _modules_mutex;
+
+  // The memory manager most recently created on this thread. The object layer
+  // creates a memory manager and loads the object into it on the same thread,
+  // so the load notification uses it to tell which module the memory is for.
+  inline static thread_local PooledMemoryManager *_loading_memory_manager =
+      nullptr;
+
+  // Told about every object loaded and freed, e.g. to register code with GDB.
+  // The objects are known by keys of their own, as lazily compiled modules
+  // may load several objects with the same module key. Guarded by the
+  // modules' mutex, as are the keys of the objects loaded.
+  vector<llvm::JITEventListener *> _listeners;
+  set<llvm::JITEventListener::ObjectKey> _objects;
+  llvm::JITEventListener::ObjectKey _next_object = 1;
+
+  // Recompiles hot functions in the background, one at a time. Declared last,
+  // so that it waits for the recompilations before anything else is destroyed.
+  unique_ptr<llvm::ThreadPool> _recompile_pool;
+
 public:
   // Static named initializer to initialize with default target and data layout.
-  static llvm::Expected<unique_ptr<JIT>> Create() {
-    auto jtmb = llvm::orc::JITTargetMachineBuilder::detectHost();
+  static llvm::Expected<unique_ptr<JIT>>
+  Create(const Options &options, Statistics *statistics = nullptr) {
+    auto jtmb = detect_host(options);
 
     if (!jtmb)
       return jtmb.takeError();
@@ -49,7 +197,78 @@ public:
     if (!data_layout)
       return data_layout.takeError();
 
-    return std::make_unique<JIT>(move(*jtmb), move(*data_layout));
+    auto jit = std::make_unique<JIT>(move(*jtmb), move(*data_layout));
+    jit->_statistics = statistics;
+
+    if (options.gdb)
+      jit->_listeners.push_back(llvm::JITEventListener::createGDBRegistrationListener());
+
+    if (options.perf) {
+      if (auto *map = PerfMap::get())
+        jit->_listeners.push_back(map);
+
+      // Writing jitdump files, for perf inject, needs LLVM built with perf
+      // support
+      if (auto *listener = llvm::JITEventListener::createPerfJITEventListener())
+        jit->_listeners.push_back(listener);
+    }
+
+    if (options.lazy)
+      if (auto error = jit->enable_lazy_compilation())
+        return move(error);
+
+    if (options.tiered)
+      if (auto error = jit->enable_tiered_compilation(options.hot_threshold))
+        return move(error);
+
+    if (options.redefinable)
+      if (auto error = jit->enable_redefinition())
+        return move(error);
+
+    if (options.cache)
+      jit->_object_cache = std::make_unique<ObjectCache>(
+          options.cache,
+          options.cache_limit * 1024 * 1024,
+          jit->_triple.str() + " " + llvm::sys::getHostCPUName().str() + " " +
+              jit->_jtmb.getFeatures().getString() + " fast-math=" +
+              to_string(options.fast_math));
+
+    return move(jit);
+  }
+
+  // Targets the host's CPU, so that code uses every instruction it supports,
+  // e.g. AVX2 or FMA, with the floating-point semantics of the options.
+  // Unless host_cpu is set, targets a generic CPU of the host's architecture
+  // instead, as detectHost() alone does, e.g. for code run on other machines.
+  static llvm::Expected<llvm::orc::JITTargetMachineBuilder>
+  detect_host(const Options &options, bool host_cpu = true) {
+    auto jtmb = llvm::orc::JITTargetMachineBuilder::detectHost();
+
+    if (!jtmb)
+      return jtmb.takeError();
+
+    if (host_cpu) {
+      jtmb->setCPU(llvm::sys::getHostCPUName().str());
+
+      llvm::StringMap<bool> features;
+
+      if (llvm::sys::getHostCPUFeatures(features))
+        for (auto &feature : features)
+          jtmb->getFeatures().AddFeature(feature.first(), feature.second);
+    }
+
+    // The IR carries the fast-math flags of every operation; these let the
+    // code generator apply them to the operations it creates itself
+    auto &target_options = jtmb->getOptions();
+    target_options.AllowFPOpFusion = options.fast_math & Options::Contract
+        ? llvm::FPOpFusion::Fast
+        : llvm::FPOpFusion::Standard;
+    target_options.NoNaNsFPMath = options.fast_math & Options::NoNaNs;
+    target_options.NoInfsFPMath = options.fast_math & Options::NoInfs;
+    target_options.NoSignedZerosFPMath = options.fast_math & Options::NoSignedZeros;
+    target_options.UnsafeFPMath = options.fast_math == Options::Fast;
+
+    return move(*jtmb);
   }
 
   JIT(llvm::orc::JITTargetMachineBuilder jtmb, llvm::DataLayout data_layout) :
@@ -60,7 +279,37 @@ public:
           // each module that is added (a JIT memory manager manages memory
           // allocations, memory permissions, and registration of exception
           // handlers for JIT’d code)
-          []() { return std::make_unique<llvm::SectionMemoryManager>(); }),
+          [this]() {
+            auto memory_manager =
+                std::make_unique<PooledMemoryManager>(&_memory_pool, _statistics);
+            _loading_memory_manager = memory_manager.get();
+            return memory_manager;
+          },
+          // ... and a function called once an object is loaded into memory
+          [this](
+              llvm::orc::VModuleKey key,
+              const llvm::object::ObjectFile &object,
+              const llvm::RuntimeDyld::LoadedObjectInfo &info) {
+            lock_guard<mutex> lock(_modules_mutex);
+
+            auto object_key = notify_loaded(object, info);
+
+            auto module = _modules.find(key);
+            if (module != _modules.end()) {
+              module->second.memory_managers.push_back(_loading_memory_manager);
+
+              if (object_key)
+                module->second.objects.push_back(object_key);
+            }
+          }),
+
+      _jtmb(jtmb),
+      _triple(jtmb.getTargetTriple()),
+
+      // The ConcurrentIRCompiler utility will use the JITTargetMachineBuilder
+      // to build llvm TargetMachines (which are not thread safe) as needed for
+      // compiles
+      _compiler(std::move(jtmb)),
 
       // The CompileLayer needs three things: ...
       _ir_compile_layer(
@@ -68,33 +317,679 @@ public:
           _execution_session,
           // ... (2) A reference to our object layer
           _object_layer,
-          // ... (3) a compiler instance to use to perform the actual
-          // compilation from IR to object files ...
-          //
-          // ... The ConcurrentIRCompiler utility will use the
-          // JITTargetMachineBuilder to build llvm TargetMachines (which are not
-          // thread safe) as needed for compiles
-          llvm::orc::ConcurrentIRCompiler(std::move(jtmb))),
+          // ... (3) a function to perform the actual compilation from IR to
+          // object files
+          [this](llvm::Module &module) { return compile(module); }),
 
       _data_layout(std::move(data_layout)),
       _mangle(_execution_session, this->_data_layout),
       _context(std::make_unique<llvm::LLVMContext>()) {
-    _execution_session.getMainJITDylib().setGenerator(llvm::cantFail(
-        llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
-            _data_layout)));
+    search_process(_execution_session.getMainJITDylib());
+  }
+
+  ~JIT() {
+    if (_recompile_pool)
+      _recompile_pool->wait();
+
+    // The code of the objects left is freed along with the JIT
+    lock_guard<mutex> lock(_modules_mutex);
+
+    for (auto object : _objects)
+      for (auto *listener : _listeners)
+        listener->notifyFreeingObject(object);
   }
 
   const llvm::DataLayout &data_layout() const { return _data_layout; }
   llvm::LLVMContext &context() { return *_context.getContext(); }
+  size_t materialized_functions() const { return _materialized_functions; }
+  size_t promoted_functions() const { return _promoted_functions; }
 
-  void add_module(unique_ptr<llvm::Module> module) {
-    llvm::cantFail(_ir_compile_layer.add(
+  // Creates a target machine for the JIT's target, e.g. for the optimizer
+  // to query. Target machines are not thread safe, so every thread needs one.
+  llvm::Expected<unique_ptr<llvm::TargetMachine>> create_target_machine() {
+    return _jtmb.createTargetMachine();
+  }
+  ObjectCache *object_cache() { return _object_cache.get(); }
+
+  // The memory of the code and data loaded, e.g. to report how much is live.
+  MemoryPool &memory_pool() { return _memory_pool; }
+
+  // Creates a JITDylib of its own, e.g. for a session of a server, whose
+  // symbols other dylibs do not see. Symbols of the process are visible.
+  // Dylibs cannot be removed, but the modules added to them can.
+  llvm::orc::JITDylib &create_dylib(const string &name) {
+    auto &dylib = _execution_session.createJITDylib(name);
+    search_process(dylib);
+
+    return dylib;
+  }
+
+  // Adds the module to the JIT. The returned key can be passed to
+  // remove_module() once the module's code is no longer needed.
+  //
+  // In the lazy mode functions are compiled on their first call,
+  // unless the module is *eager*, e.g. because it is about to be run anyway.
+  // The module is added to the main dylib unless another one is given.
+  // Only the main dylib supports the tiered and redefinable modes.
+  //
+  // In the tiered mode functions are compiled by the baseline tier first,
+  // unless the module is eager. In the redefinable mode the functions of a
+  // module which is not eager replace any earlier definitions, and are
+  // compiled right away.
+  llvm::Expected<llvm::orc::VModuleKey>
+  add_module(
+      unique_ptr<llvm::Module> module,
+      bool eager = false,
+      llvm::orc::JITDylib *dylib = nullptr) {
+    return add_module(
+        llvm::orc::ThreadSafeModule(move(module), _context), eager, dylib);
+  }
+
+  // Adds the module created in a context of its own.
+  llvm::Expected<llvm::orc::VModuleKey>
+  add_module(
+      llvm::orc::ThreadSafeModule module,
+      bool eager = false,
+      llvm::orc::JITDylib *dylib = nullptr) {
+    if (!dylib)
+      dylib = &_execution_session.getMainJITDylib();
+
+    if (_redefinable && !eager)
+      return add_definitions(move(module));
+
+    auto key = _execution_session.allocateVModule();
+    Module record;
+    record.dylib = dylib;
+
+    for (auto &function : module.getModule()->functions())
+      if (!function.isDeclaration() && !function.hasLocalLinkage() &&
+          !function.hasAvailableExternallyLinkage())
+        record.symbols.insert(_mangle(function.getName()));
+
+    vector<TieredFunction *> baseline;
+
+    if (_stubs_manager && !eager) {
+      auto functions = instrument(*module.getModule(), key, record.symbols);
+
+      if (!functions)
+        return functions.takeError();
+
+      baseline = move(*functions);
+    }
+
+    {
+      lock_guard<mutex> lock(_modules_mutex);
+      _modules[key] = move(record);
+    }
+
+    llvm::orc::IRLayer *layer = &_ir_compile_layer;
+
+    if (_compile_on_demand_layer && !eager)
+      layer = _compile_on_demand_layer.get();
+
+    if (!baseline.empty())
+      layer = _baseline_compile_layer.get();
+
+    if (auto error = layer->add(*dylib, move(module), key)) {
+      if (baseline.empty())
+        forget_module(key);
+      else
+        error = llvm::joinErrors(move(error), remove_module(key));
+
+      return move(error);
+    }
+
+    // Compile the baseline code right away and point the stubs to it
+    for (auto *function : baseline) {
+      auto symbol = lookup(function->name + ".tier0");
+
+      if (!symbol)
+        return llvm::joinErrors(symbol.takeError(), remove_module(key));
+
+      if (auto error = _stubs_manager->updatePointer(
+              *_mangle(function->name), symbol->getAddress()))
+        return llvm::joinErrors(move(error), remove_module(key));
+    }
+
+    return key;
+  }
+
+  // Removes the module's symbols from the JIT and frees its code and data.
+  // The module must not be running, nor called by any other code afterwards.
+  llvm::Error remove_module(llvm::orc::VModuleKey key) {
+    llvm::orc::JITDylib *dylib = nullptr;
+    llvm::orc::SymbolNameSet symbols;
+    vector<llvm::orc::VModuleKey> recompiled;
+
+    {
+      lock_guard<mutex> lock(_modules_mutex);
+
+      auto module = _modules.find(key);
+      if (module == _modules.end())
+        return llvm::Error::success();
+
+      dylib = module->second.dylib;
+      symbols = module->second.symbols;
+      recompiled = module->second.recompiled;
+    }
+
+    if (auto error = dylib->remove(symbols))
+      return error;
+
+    forget_module(key);
+
+    auto error = llvm::Error::success();
+
+    for (auto recompiled_key : recompiled)
+      error = llvm::joinErrors(move(error), remove_module(recompiled_key));
+
+    return error;
+  }
+
+  // Compiles the module into an object, which can then be added with
+  // add_object(). Safe to call from many threads, for modules in distinct
+  // contexts.
+  llvm::Expected<unique_ptr<llvm::MemoryBuffer>> compile_object(llvm::Module &module) {
+    return compile(module);
+  }
+
+  // Adds the compiled object to the JIT. Objects are not removable.
+  llvm::Error add_object(unique_ptr<llvm::MemoryBuffer> object) {
+    return _object_layer.add(
         _execution_session.getMainJITDylib(),
-        llvm::orc::ThreadSafeModule(move(module), _context)));
+        move(object),
+        _execution_session.allocateVModule());
+  }
+
+  // Looks the symbol up in the main dylib, unless another one is given.
+  llvm::Expected<llvm::JITEvaluatedSymbol>
+  lookup(llvm::StringRef name, llvm::orc::JITDylib *dylib = nullptr) {
+    if (!dylib)
+      dylib = &_execution_session.getMainJITDylib();
+
+    return _execution_session.lookup({dylib}, _mangle(name.str()));
+  }
+
+  // Looks the symbol up as lookup() does, returning its address,
+  // or 0 if it cannot be found.
+  uint64_t address_of(llvm::StringRef name, llvm::orc::JITDylib *dylib = nullptr) {
+    auto symbol = lookup(name, dylib);
+
+    if (!symbol) {
+      llvm::consumeError(symbol.takeError());
+      return 0;
+    }
+
+    return symbol->getAddress();
+  }
+
+private:
+  llvm::Error enable_lazy_compilation() {
+    auto lazy_call_through_manager = llvm::orc::createLocalLazyCallThroughManager(
+        _triple,
+        _execution_session,
+        llvm::pointerToJITTargetAddress(&lazy_compilation_failed));
+
+    if (!lazy_call_through_manager)
+      return lazy_call_through_manager.takeError();
+
+    auto stubs_manager_builder =
+        llvm::orc::createLocalIndirectStubsManagerBuilder(_triple);
+
+    if (!stubs_manager_builder)
+      return llvm::make_error<llvm::StringError>(
+          "No indirect stubs manager for " + _triple.str(),
+          llvm::inconvertibleErrorCode());
+
+    _lazy_call_through_manager = move(*lazy_call_through_manager);
+    _compile_on_demand_layer = std::make_unique<llvm::orc::CompileOnDemandLayer>(
+        _execution_session,
+        _ir_compile_layer,
+        *_lazy_call_through_manager,
+        move(stubs_manager_builder));
+
+    // Compile only the function being called, not the whole module
+    _compile_on_demand_layer->setPartitionFunction(
+        llvm::orc::CompileOnDemandLayer::compileRequested);
+
+    return llvm::Error::success();
   }
 
-  llvm::Expected<llvm::JITEvaluatedSymbol> lookup(llvm::StringRef name) {
-    return _execution_session.lookup(
-        {&_execution_session.getMainJITDylib()}, _mangle(name.str()));
+  llvm::Error enable_tiered_compilation(uint64_t hot_threshold) {
+    if (auto error = create_stubs_manager())
+      return error;
+
+    _hot_threshold = hot_threshold;
+
+    // The baseline code is compiled with the JIT's default, fast code generation
+    _baseline_compile_layer = std::make_unique<llvm::orc::IRCompileLayer>(
+        _execution_session,
+        _object_layer,
+        [this](llvm::Module &module) {
+          Statistics::Timer timer(_statistics, Statistics::Phase::Materialization);
+          return _compiler(module);
+        });
+
+    _recompile_pool = std::make_unique<llvm::ThreadPool>(1);
+
+    return llvm::Error::success();
+  }
+
+  llvm::Error enable_redefinition() {
+    if (auto error = create_stubs_manager())
+      return error;
+
+    _redefinable = true;
+    return llvm::Error::success();
+  }
+
+  llvm::Error create_stubs_manager() {
+    auto stubs_manager_builder =
+        llvm::orc::createLocalIndirectStubsManagerBuilder(_triple);
+
+    if (!stubs_manager_builder)
+      return llvm::make_error<llvm::StringError>(
+          "No indirect stubs manager for " + _triple.str(),
+          llvm::inconvertibleErrorCode());
+
+    _stubs_manager = stubs_manager_builder();
+    return llvm::Error::success();
+  }
+
+  // Adds the new versions of the functions the module defines, pointing
+  // their stubs to them once they are compiled. Modules left without any
+  // latest version are removed, freeing the code of the replaced versions.
+  llvm::Expected<llvm::orc::VModuleKey>
+  add_definitions(llvm::orc::ThreadSafeModule module) {
+    auto key = _execution_session.allocateVModule();
+    auto suffix = ".v" + to_string(++_version);
+    Module record;
+    record.dylib = &_execution_session.getMainJITDylib();
+    vector<string> names;
+    vector<string> stubbed;
+    llvm::orc::SymbolMap stubs;
+
+    for (auto *definition : rename_definitions(*module.getModule(), suffix)) {
+      string name = definition->getName().drop_back(suffix.size());
+      auto mangled_name = _mangle(name);
+
+      record.symbols.insert(_mangle(definition->getName()));
+      names.push_back(name);
+
+      // The first definition of the function gets a stub, which stays
+      if (_stubbed.count(name))
+        continue;
+
+      if (auto error = _stubs_manager->createStub(
+              *mangled_name,
+              llvm::pointerToJITTargetAddress(&baseline_missing),
+              llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable))
+        return move(error);
+
+      stubs[mangled_name] = _stubs_manager->findStub(*mangled_name, false);
+      stubbed.push_back(name);
+    }
+
+    if (!stubs.empty())
+      if (auto error = _execution_session.getMainJITDylib().define(
+              llvm::orc::absoluteSymbols(move(stubs))))
+        return move(error);
+
+    // Whatever happens to this version, later ones reuse the stubs
+    _stubbed.insert(stubbed.begin(), stubbed.end());
+
+    {
+      lock_guard<mutex> lock(_modules_mutex);
+      _modules[key] = move(record);
+    }
+
+    if (auto error = _ir_compile_layer.add(
+            _execution_session.getMainJITDylib(), move(module), key)) {
+      forget_module(key);
+      return move(error);
+    }
+
+    // Compile the new versions before any stub points to them, so that
+    // a function which fails to compile keeps its earlier version
+    vector<llvm::JITTargetAddress> addresses;
+
+    for (auto &name : names) {
+      auto symbol = lookup(name + suffix);
+
+      if (!symbol)
+        return llvm::joinErrors(symbol.takeError(), remove_module(key));
+
+      addresses.push_back(symbol->getAddress());
+    }
+
+    // The bookkeeping follows the stubs as they are updated, so that it still
+    // matches them should updating one fail
+    vector<llvm::orc::VModuleKey> replaced;
+    llvm::Error error = llvm::Error::success();
+
+    for (size_t i = 0; i < names.size(); i++) {
+      if (auto update_error =
+              _stubs_manager->updatePointer(*_mangle(names[i]), addresses[i])) {
+        error = llvm::joinErrors(move(error), move(update_error));
+        break;
+      }
+
+      auto latest = _latest_modules.find(names[i]);
+
+      if (latest != _latest_modules.end() && --_latest_definitions[latest->second] == 0) {
+        _latest_definitions.erase(latest->second);
+        replaced.push_back(latest->second);
+      }
+
+      _latest_modules[names[i]] = key;
+      _latest_definitions[key]++;
+    }
+
+    // Nothing calls the replaced versions anymore, nor this one if no stub
+    // could be pointed to it
+    if (error && !_latest_definitions.count(key))
+      replaced.push_back(key);
+
+    for (auto replaced_key : replaced)
+      error = llvm::joinErrors(move(error), remove_module(replaced_key));
+
+    if (error)
+      return move(error);
+
+    return key;
+  }
+
+  // Called by a call-through stub instead of the function if the function's
+  // body could not be compiled, with the function's arguments. Only the
+  // calling session is told, by the NaN returned in place of the result.
+  static double lazy_compilation_failed() {
+    fprintf(Diagnostics::output, "JIT error: failed to compile a function lazily\n");
+    return numeric_limits<double>::quiet_NaN();
+  }
+
+  void search_process(llvm::orc::JITDylib &dylib) {
+    dylib.setGenerator(llvm::cantFail(
+        llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            _data_layout)));
+  }
+
+  // Called by a stub before its function's code is compiled, with the
+  // function's arguments. Returns NaN in place of the result, as
+  // lazy_compilation_failed() does.
+  static double baseline_missing() {
+    fprintf(Diagnostics::output, "JIT error: called a function before compiling it\n");
+    return numeric_limits<double>::quiet_NaN();
+  }
+
+  // Prepares the functions the module defines for the baseline tier,
+  // returning them. The module is kept as bitcode to be recompiled from.
+  // Every function is renamed with a ".tier0" suffix and counts its calls,
+  // while its own name is given to a stub, which the caller points to the
+  // baseline code once it is compiled.
+  llvm::Expected<vector<TieredFunction *>>
+  instrument(
+      llvm::Module &module,
+      llvm::orc::VModuleKey key,
+      llvm::orc::SymbolNameSet &symbols) {
+    auto bitcode = std::make_shared<string>();
+
+    {
+      llvm::raw_string_ostream stream(*bitcode);
+      llvm::WriteBitcodeToFile(module, stream);
+    }
+
+    vector<TieredFunction *> functions;
+    llvm::orc::SymbolMap stubs;
+
+    for (auto *definition : rename_definitions(module, ".tier0")) {
+      string name = definition->getName().rsplit('.').first;
+      auto mangled_name = _mangle(name);
+
+      {
+        lock_guard<mutex> lock(_modules_mutex);
+        _tiered_functions.push_back(
+            std::make_unique<TieredFunction>(this, name, key, bitcode));
+        functions.push_back(_tiered_functions.back().get());
+      }
+
+      count_calls(*definition, functions.back());
+
+      if (auto error = _stubs_manager->createStub(
+              *mangled_name,
+              llvm::pointerToJITTargetAddress(&baseline_missing),
+              llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable))
+        return move(error);
+
+      stubs[mangled_name] = _stubs_manager->findStub(*mangled_name, false);
+      symbols.insert(_mangle(definition->getName()));
+    }
+
+    if (auto error = _execution_session.getMainJITDylib().define(
+            llvm::orc::absoluteSymbols(move(stubs))))
+      return move(error);
+
+    return functions;
+  }
+
+  // Renames the functions the module defines, apart from the imported ones,
+  // by appending the suffix to their names. Calls then go to declarations
+  // with the original names, i.e. through the stubs. Returns the functions.
+  static vector<llvm::Function *>
+  rename_definitions(llvm::Module &module, llvm::StringRef suffix) {
+    vector<llvm::Function *> definitions;
+
+    for (auto &function : module.functions())
+      if (!function.isDeclaration() && !function.hasLocalLinkage() &&
+          !function.hasAvailableExternallyLinkage())
+        definitions.push_back(&function);
+
+    for (auto *definition : definitions) {
+      string name = definition->getName();
+      definition->setName(name + suffix.str());
+
+      auto *declaration = llvm::Function::Create(
+          definition->getFunctionType(),
+          llvm::Function::ExternalLinkage,
+          name,
+          &module);
+
+      definition->replaceAllUsesWith(declaration);
+    }
+
+    return definitions;
+  }
+
+  // Makes the function count its calls on entry, calling promote() once it
+  // reaches the hot threshold. The counter and the hook are referred to by
+  // their addresses.
+  void count_calls(llvm::Function &function, TieredFunction *tiered_function) {
+    auto &context = function.getContext();
+    auto *body = &function.getEntryBlock();
+    auto *count = llvm::BasicBlock::Create(context, "count", &function, body);
+    auto *promote = llvm::BasicBlock::Create(context, "promote", &function, body);
+
+    llvm::IRBuilder<> builder(count);
+    auto *int64 = builder.getInt64Ty();
+    auto *pointer = builder.getInt8PtrTy();
+
+    auto *counter = builder.CreateIntToPtr(
+        builder.getInt64(llvm::pointerToJITTargetAddress(&tiered_function->calls)),
+        int64->getPointerTo());
+    auto *calls = builder.CreateAdd(builder.CreateLoad(counter), builder.getInt64(1));
+    builder.CreateStore(calls, counter);
+    builder.CreateCondBr(
+        builder.CreateICmpEQ(calls, builder.getInt64(_hot_threshold)), promote, body);
+
+    builder.SetInsertPoint(promote);
+    auto *hook_type = llvm::FunctionType::get(builder.getVoidTy(), {pointer}, false);
+    auto *hook = builder.CreateIntToPtr(
+        builder.getInt64(llvm::pointerToJITTargetAddress(&JIT::promote)),
+        hook_type->getPointerTo());
+    builder.CreateCall(
+        hook_type,
+        hook,
+        {builder.CreateIntToPtr(
+            builder.getInt64(llvm::pointerToJITTargetAddress(tiered_function)),
+            pointer)});
+    builder.CreateBr(body);
+  }
+
+  // Called by the baseline code once the function is hot. The function is
+  // recompiled in the background, the baseline code running meanwhile.
+  static void promote(TieredFunction *function) {
+    if (function->promoted.exchange(true))
+      return;
+
+    auto *jit = function->jit;
+    jit->_recompile_pool->async([jit, function] {
+      if (auto error = jit->recompile(*function))
+        llvm::logAllUnhandledErrors(move(error), llvm::errs(), "JIT error: ");
+    });
+  }
+
+  // Recompiles the function at full optimization from the module it was
+  // defined in, and points its stub to the new code. The module's other
+  // functions are only declared, while the bodies imported into it may still
+  // be inlined.
+  llvm::Error recompile(TieredFunction &function) {
+    llvm::LLVMContext context;
+    auto module = llvm::parseBitcodeFile(
+        llvm::MemoryBufferRef(*function.bitcode, function.name), context);
+
+    if (!module)
+      return module.takeError();
+
+    for (auto &other : (*module)->functions())
+      if (other.getName() != function.name && !other.isDeclaration() &&
+          !other.hasAvailableExternallyLinkage())
+        other.deleteBody();
+
+    Module record;
+    record.dylib = &_execution_session.getMainJITDylib();
+
+    for (auto *definition : rename_definitions(**module, ".tier1"))
+      record.symbols.insert(_mangle(definition->getName()));
+
+    auto jtmb = _jtmb;
+    jtmb.setCodeGenOptLevel(llvm::CodeGenOpt::Aggressive);
+
+    auto optimizer_target_machine = jtmb.createTargetMachine();
+
+    if (!optimizer_target_machine)
+      return optimizer_target_machine.takeError();
+
+    Optimizer(3, move(*optimizer_target_machine), _statistics).optimize(**module);
+
+    auto target_machine = jtmb.createTargetMachine();
+
+    if (!target_machine)
+      return target_machine.takeError();
+
+    llvm::orc::SimpleCompiler compiler(**target_machine);
+    auto object = compile(**module, compiler);
+
+    if (!object)
+      return object.takeError();
+
+    // The optimized code is removed along with the baseline code
+    auto key = _execution_session.allocateVModule();
+
+    {
+      lock_guard<mutex> lock(_modules_mutex);
+
+      auto baseline = _modules.find(function.module);
+
+      // The function was removed while it was being recompiled
+      if (baseline == _modules.end()) {
+        _execution_session.releaseVModule(key);
+        return llvm::Error::success();
+      }
+
+      baseline->second.recompiled.push_back(key);
+      _modules[key] = move(record);
+    }
+
+    if (auto error = _object_layer.add(
+            _execution_session.getMainJITDylib(), move(*object), key))
+      return llvm::joinErrors(move(error), remove_module(key));
+
+    auto symbol = lookup(function.name + ".tier1");
+
+    if (!symbol)
+      return symbol.takeError();
+
+    if (auto error = _stubs_manager->updatePointer(
+            *_mangle(function.name), symbol->getAddress()))
+      return error;
+
+    _promoted_functions++;
+    return llvm::Error::success();
+  }
+
+  llvm::Expected<unique_ptr<llvm::MemoryBuffer>> compile(llvm::Module &module) {
+    for (auto &function : module.functions())
+      if (!function.isDeclaration())
+        _materialized_functions++;
+
+    return compile(module, _compiler);
+  }
+
+  // Compiles the module with the compiler, unless its object is cached.
+  template <typename Compiler>
+  llvm::Expected<unique_ptr<llvm::MemoryBuffer>>
+  compile(llvm::Module &module, Compiler &compiler) {
+    Statistics::Timer timer(_statistics, Statistics::Phase::Materialization);
+
+    if (!_object_cache)
+      return compiler(module);
+
+    auto key = _object_cache->key(module);
+
+    if (auto object = _object_cache->load(key))
+      return move(object);
+
+    auto object = compiler(module);
+
+    if (object)
+      _object_cache->store(key, object->getMemBufferRef());
+
+    return move(object);
+  }
+
+  void forget_module(llvm::orc::VModuleKey key) {
+    lock_guard<mutex> lock(_modules_mutex);
+
+    auto module = _modules.find(key);
+    if (module == _modules.end())
+      return;
+
+    // Listeners forget the code before it is freed
+    for (auto object : module->second.objects)
+      if (_objects.erase(object))
+        for (auto *listener : _listeners)
+          listener->notifyFreeingObject(object);
+
+    for (auto *memory_manager : module->second.memory_managers)
+      memory_manager->release();
+
+    _modules.erase(module);
+    _execution_session.releaseVModule(key);
+  }
+
+  // Tells the listeners about the object, returning the key they know it by,
+  // or 0 without listeners. The modules' mutex must be held.
+  llvm::JITEventListener::ObjectKey notify_loaded(
+      const llvm::object::ObjectFile &object,
+      const llvm::RuntimeDyld::LoadedObjectInfo &info) {
+    if (_listeners.empty())
+      return 0;
+
+    auto key = _next_object++;
+    _objects.insert(key);
+
+    for (auto *listener : _listeners)
+      listener->notifyObjectLoaded(key, object, info);
+
+    return key;
   }
 };
@@ -0,0 +1,317 @@
+#include "./kaleidoscope.h"
+
+#include <cstdio>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include "./codegen.cpp"
+#include "./inline_library.cpp"
+#include "./jit.cpp"
+#include "./kernel.cpp"
+#include "./lexer.cpp"
+#include "./optimizer.cpp"
+#include "./parser.cpp"
+
+namespace kaleidoscope {
+
+struct Session::Implementation {
+  // A compiled function. The address is looked up on first use.
+  struct Function {
+    int arity;
+    uintptr_t address = 0;
+  };
+
+  Options options;
+
+  unique_ptr<JIT> jit;
+  unique_ptr<llvm::IRBuilder<>> builder;
+  unique_ptr<Codegen> codegen;
+  unique_ptr<Optimizer> optimizer;
+  unique_ptr<InlineLibrary> inline_library;
+
+  // The parser keeps the symbols interned by earlier sources,
+  // which the code generator knows the functions by.
+  Lexer empty_lexer{string_view("")};
+  Parser parser{&empty_lexer};
+
+  // Serializes compiling, removing, and looking up functions which may not
+  // be compiled yet, as all of them use the session's LLVMContext.
+  mutex compile_mutex;
+
+  // Compiled functions and kernels by name, read by any thread.
+  unordered_map<string, Function> functions;
+  shared_mutex functions_mutex;
+
+  Implementation(const Options &options) : options(options) {
+    jit = llvm::cantFail(JIT::Create(options));
+    builder = std::make_unique<llvm::IRBuilder<>>(jit->context());
+    codegen = std::make_unique<Codegen>(&jit->context(), builder.get());
+    codegen->set_fast_math(options.fast_math);
+    codegen->set_math_intrinsics(options.math_intrinsics);
+    optimizer = std::make_unique<Optimizer>(
+        options.tiered ? 0 : options.level,
+        llvm::cantFail(jit->create_target_machine()));
+    inline_library = std::make_unique<InlineLibrary>(jit->context());
+  }
+
+  Handle compile(string_view source, bool kernels) {
+    lock_guard<mutex> lock(compile_mutex);
+
+    // The whole source is compiled into a single module
+    auto module = std::make_unique<llvm::Module>("Session", jit->context());
+    module->setDataLayout(jit->data_layout());
+    codegen->set_module(module.get());
+
+    Lexer lexer(source);
+    parser.set_lexer(&lexer);
+
+    vector<llvm::Function *> definitions;
+    bool success = read(definitions);
+
+    parser.set_lexer(&empty_lexer);
+
+    // The module is dropped, so are its definitions
+    if (!success) {
+      for (auto *definition : definitions)
+        codegen->undefine(parser.symbols()->intern(definition->getName().str()));
+
+      return Handle();
+    }
+
+    Handle handle;
+    handle._kernels = kernels;
+
+    for (auto *definition : definitions) {
+      handle._functions.push_back(definition->getName());
+
+      if (kernels)
+        Kernel::build(*definition);
+    }
+
+    if (optimizer->level() > 0 || options.tiered)
+      inline_library->import_into(*module);
+
+    optimizer->optimize(*module);
+
+    if (!options.tiered)
+      InlineLibrary::strip(*module);
+
+    // Bodies are only kept for inlining once the JIT has accepted them
+    auto inlinable = llvm::CloneModule(*module);
+    auto key = jit->add_module(move(module));
+
+    if (!key) {
+      log_error(key.takeError());
+
+      for (auto &name : handle._functions)
+        codegen->undefine(parser.symbols()->intern(name));
+
+      return Handle();
+    }
+
+    inline_library->add(*inlinable);
+
+    handle._key = *key;
+    handle._compiled = true;
+
+    unique_lock<shared_mutex> functions_lock(functions_mutex);
+
+    for (auto *definition : definitions) {
+      functions[definition->getName()] = {(int)definition->arg_size()};
+
+      if (kernels)
+        functions[Kernel::name(definition->getName())] = {-1};
+    }
+
+    return handle;
+  }
+
+  // Read every item of the source, generating the definitions into the
+  // current module. Returns false if any of the items has failed.
+  bool read(vector<llvm::Function *> &definitions) {
+    auto *lexer = parser.lexer();
+    bool success = true;
+
+    lexer->consume_token();
+
+    while (true) {
+      switch (lexer->current_token()) {
+      case Lexer::Token::Eof:
+        return success;
+      case Lexer::Token::Newline:
+        lexer->reset();
+        lexer->consume_token();
+        break;
+      case ';':
+        lexer->consume_token(); // Consume top-level semicolon
+        break;
+      case Lexer::Token::Def:
+        if (auto node = parser.parse_function_definition()) {
+          if (auto *function = (llvm::Function *)codegen->gen(node))
+            definitions.push_back(function);
+          else
+            success = false;
+        } else {
+          // That's a error, skip one token
+          lexer->consume_token();
+          success = false;
+        }
+        break;
+      case Lexer::Token::Extern:
+        if (auto node = parser.parse_extern())
+          success &= codegen->gen(node) != nullptr;
+        else {
+          lexer->consume_token();
+          success = false;
+        }
+        break;
+      default:
+        fprintf(stderr, "Error: Top-level expressions cannot be compiled\n");
+
+        if (!parser.parse_top_level_expression())
+          lexer->consume_token();
+
+        success = false;
+        break;
+      }
+
+      // The nodes of the item are no longer needed once it is generated
+      parser.arena()->reset();
+    }
+  }
+
+  bool remove(const Handle &handle) {
+    if (!handle)
+      return false;
+
+    lock_guard<mutex> lock(compile_mutex);
+
+    {
+      unique_lock<shared_mutex> functions_lock(functions_mutex);
+
+      for (auto &name : handle._functions) {
+        functions.erase(name);
+        codegen->undefine(parser.symbols()->intern(name));
+
+        if (handle._kernels)
+          functions.erase(Kernel::name(name));
+      }
+    }
+
+    if (auto error = jit->remove_module(handle._key)) {
+      log_error(move(error));
+      return false;
+    }
+
+    return true;
+  }
+
+  uintptr_t address_of(string_view name, int arity, bool kernel) {
+    string key(name);
+
+    if (kernel)
+      key = Kernel::name(key);
+
+    {
+      shared_lock<shared_mutex> lock(functions_mutex);
+
+      auto function = functions.find(key);
+      if (function == functions.end())
+        return 0;
+
+      if (arity != -1 && function->second.arity != arity)
+        return 0;
+
+      if (function->second.address)
+        return function->second.address;
+    }
+
+    // The lookup compiles the function if it has not been yet, in the
+    // session's context, so it is serialized with compiling. The functions'
+    // lock is not held meanwhile, for other functions to be read.
+    lock_guard<mutex> compile_lock(compile_mutex);
+
+    {
+      shared_lock<shared_mutex> lock(functions_mutex);
+
+      auto function = functions.find(key);
+      if (function == functions.end())
+        return 0;
+
+      // Another thread may have looked it up meanwhile
+      if (function->second.address)
+        return function->second.address;
+    }
+
+    auto symbol = jit->lookup(key);
+
+    if (!symbol) {
+      log_error(symbol.takeError());
+      return 0;
+    }
+
+    unique_lock<shared_mutex> lock(functions_mutex);
+
+    auto function = functions.find(key);
+    if (function == functions.end())
+      return 0;
+
+    return function->second.address = symbol->getAddress();
+  }
+
+  static void log_error(llvm::Error error) {
+    llvm::logAllUnhandledErrors(move(error), llvm::errs(), "JIT error: ");
+  }
+};
+
+std::unique_ptr<Session> Session::create(const Options &options) {
+  if (!options.check())
+    return nullptr;
+
+  // Lazily compiled functions would be compiled by the threads calling them,
+  // in the session's context, while other sources are compiled in it
+  if (options.engine != Options::Engine::LLVM || options.lazy || options.redefinable ||
+      options.memoize || options.socket || options.script) {
+    fprintf(
+        stderr,
+        "Error: sessions cannot be created with --engine=vm, --lazy, "
+        "--redefinable, --memoize, --socket or --script\n");
+    return nullptr;
+  }
+
+  return std::unique_ptr<Session>(new Session(options));
+}
+
+Session::Session(const Options &options) {
+  static once_flag initialized;
+
+  call_once(initialized, [] {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+  });
+
+  _implementation = std::make_unique<Implementation>(options);
+}
+
+Session::~Session() = default;
+
+Handle Session::compile(string_view source, bool kernels) {
+  return _implementation->compile(source, kernels);
+}
+
+bool Session::remove(const Handle &handle) {
+  return _implementation->remove(handle);
+}
+
+uintptr_t Session::address_of(string_view name, int arity, bool kernel) {
+  return _implementation->address_of(name, arity, kernel);
+}
+} // namespace kaleidoscope
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "./options.cpp"
+
+// The embeddable compiler. Only this header is needed to use the library,
+// which keeps LLVM out of the embedding code.
+namespace kaleidoscope {
+
+// A function evaluated over columns of rows, see kernel.cpp.
+using KernelFunction = void (*)(const double *const *columns, double *out, uint64_t rows);
+
+// The functions compiled from one source, removable together.
+// A failed compilation returns an empty handle, which converts to false.
+class Handle {
+  friend class Session;
+
+  uint64_t _key = 0;
+  bool _compiled = false;
+  bool _kernels = false;
+  std::vector<std::string> _functions;
+
+public:
+  explicit operator bool() const { return _compiled; }
+
+  // The functions the source defined.
+  const std::vector<std::string> &functions() const { return _functions; }
+};
+
+// A compiler session. Sources compiled into a session may call the functions
+// defined by the sources compiled before them.
+//
+// Sources may be compiled from any thread, one at a time. Compiled functions
+// are plain machine code: any number of threads may call them at once, with
+// no locks involved, until their handle is removed.
+class Session {
+  struct Implementation;
+  std::unique_ptr<Implementation> _implementation;
+
+  explicit Session(const Options &options);
+
+public:
+  // Creates a session, or returns nullptr if the options cannot be combined
+  // or are not supported by sessions, which only compile eagerly with LLVM,
+  // without redefinitions nor memoization. Errors are printed to stderr.
+  static std::unique_ptr<Session> create(const Options &options = Options());
+
+  ~Session();
+
+  Session(const Session &) = delete;
+
+  // Compiles the definitions and externs of the source. Top-level expressions
+  // are not allowed: define a function and call it instead. With *kernels*,
+  // every definition also gets a kernel, see get_kernel().
+  //
+  // Errors are printed to stderr, and an empty handle is returned.
+  Handle compile(std::string_view source, bool kernels = false);
+
+  // Removes the handle's functions. They must not be running,
+  // nor be called afterwards. Returns false on error.
+  bool remove(const Handle &handle);
+
+  // Returns the compiled function, or nullptr if there is no function of the
+  // name and arity, e.g. get_function<double(double, double)>("add").
+  // Addresses are cached, so repeated calls are cheap.
+  template <typename Signature>
+  Signature *get_function(std::string_view name) {
+    return reinterpret_cast<Signature *>(
+        address_of(name, Arity<Signature>::value, false));
+  }
+
+  // Returns the kernel of a function compiled with kernels, or nullptr.
+  KernelFunction get_kernel(std::string_view name) {
+    return reinterpret_cast<KernelFunction>(address_of(name, -1, true));
+  }
+
+private:
+  template <typename Signature> struct Arity;
+
+  template <typename... Args> struct Arity<double(Args...)> {
+    static_assert(
+        (std::is_same_v<Args, double> && ...),
+        "Kaleidoscope functions take and return doubles only");
+
+    static constexpr int value = sizeof...(Args);
+  };
+
+  // Returns the address of the function, or 0. An arity of -1 matches any.
+  uintptr_t address_of(std::string_view name, int arity, bool kernel);
+};
+} // namespace kaleidoscope
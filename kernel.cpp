@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Attributes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+using namespace std;
+
+// A companion of a function which evaluates it over arrays of doubles.
+// Rather than calling the function once per row, the kernel inlines it into
+// a loop which the optimizer vectorizes for the host CPU, so the module must
+// be optimized once the kernel is built.
+//
+// Argument i of the function is read from columns[i], and the result of
+// row r is written to out[r]. The output must not overlap the columns.
+class Kernel {
+public:
+  using Pointer = void (*)(const double *const *columns, double *out, uint64_t rows);
+
+  // The name of the function's kernel.
+  static string name(llvm::StringRef function) {
+    return function.str() + ".kernel";
+  }
+
+  // Builds the function's kernel in the function's module,
+  // which must define the function.
+  static llvm::Function *build(llvm::Function &function) {
+    auto &context = function.getContext();
+    llvm::IRBuilder<> builder(context);
+
+    auto *double_type = builder.getDoubleTy();
+    auto *column_type = double_type->getPointerTo();
+    auto *int64 = builder.getInt64Ty();
+
+    auto *type = llvm::FunctionType::get(
+        builder.getVoidTy(), {column_type->getPointerTo(), column_type, int64}, false);
+    auto *kernel = llvm::Function::Create(
+        type,
+        llvm::Function::ExternalLinkage,
+        name(function.getName()),
+        function.getParent());
+
+    auto *columns = kernel->arg_begin();
+    auto *out = columns + 1;
+    auto *rows = columns + 2;
+    columns->setName("columns");
+    out->setName("out");
+    rows->setName("rows");
+
+    // Writes to the output do not change the columns,
+    // so the loop needs no runtime alias checks to be vectorized
+    kernel->addParamAttr(0, llvm::Attribute::ReadOnly);
+    kernel->addParamAttr(1, llvm::Attribute::NoAlias);
+
+    auto *entry = llvm::BasicBlock::Create(context, "entry", kernel);
+    auto *loop = llvm::BasicBlock::Create(context, "loop", kernel);
+    auto *exit = llvm::BasicBlock::Create(context, "exit", kernel);
+
+    // Load the column pointers once, before the loop
+    builder.SetInsertPoint(entry);
+    vector<llvm::Value *> column_pointers;
+
+    for (unsigned i = 0; i < function.arg_size(); i++)
+      column_pointers.push_back(builder.CreateLoad(
+          builder.CreateConstInBoundsGEP1_64(columns, i), "column"));
+
+    builder.CreateCondBr(
+        builder.CreateICmpEQ(rows, builder.getInt64(0)), exit, loop);
+
+    builder.SetInsertPoint(loop);
+    auto *row = builder.CreatePHI(int64, 2, "row");
+    row->addIncoming(builder.getInt64(0), entry);
+
+    vector<llvm::Value *> args;
+
+    for (auto *column : column_pointers)
+      args.push_back(builder.CreateLoad(builder.CreateInBoundsGEP(column, row)));
+
+    auto *call = builder.CreateCall(&function, args);
+    builder.CreateStore(call, builder.CreateInBoundsGEP(out, row));
+
+    auto *next = builder.CreateNUWAdd(row, builder.getInt64(1), "next");
+    row->addIncoming(next, loop);
+    builder.CreateCondBr(builder.CreateICmpEQ(next, rows), exit, loop);
+
+    builder.SetInsertPoint(exit);
+    builder.CreateRetVoid();
+
+    // Inlined here rather than left to the optimizer, which does not inline
+    // at -O0. The function itself is kept for its other callers.
+    llvm::InlineFunctionInfo info;
+    llvm::InlineFunction(call, info);
+
+    llvm::verifyFunction(*kernel);
+
+    return kernel;
+  }
+};
@@ -1,17 +1,63 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <cstdio>
+#include <memory>
 #include <string>
+#include <string_view>
+
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "./statistics.cpp"
 
 using namespace std;
 
+// Reads tokens either from a file, one character at a time (which suits
+// interactive input), or from a buffer holding the whole source.
 class Lexer {
-  FILE *_input;
+  FILE *_input = nullptr;
   string _identifier_string;
   double _number_value;
   int _current_token;
   int _last_char = ' ';
 
+  // Only set in the buffer mode. Identifiers point directly into the source.
+  // The mode is told by a flag of its own, as an empty source may have no
+  // characters to point to.
+  bool _buffered = false;
+  unique_ptr<llvm::MemoryBuffer> _buffer;
+  const char *_cursor = nullptr;
+  const char *_end = nullptr;
+  string_view _identifier;
+
+  // Only set if statistics are collected.
+  Statistics *_statistics = nullptr;
+
+  // Character classes of the buffer mode, looked up by the character.
+  enum CharClass : uint8_t {
+    Space = 1, // Any whitespace but newline
+    Alpha = 2,
+    Digit = 4,
+    Dot = 8,
+  };
+
+  static constexpr array<uint8_t, 256> _char_classes = []() {
+    array<uint8_t, 256> classes{};
+
+    for (auto c : {' ', '\t', '\r', '\v', '\f'})
+      classes[c] = Space;
+    for (int c = 'a'; c <= 'z'; c++)
+      classes[c] = Alpha;
+    for (int c = 'A'; c <= 'Z'; c++)
+      classes[c] = Alpha;
+    for (int c = '0'; c <= '9'; c++)
+      classes[c] = Digit;
+    classes['.'] = Dot;
+
+    return classes;
+  }();
+
 public:
   enum Token {
     Eof = -1,
@@ -24,16 +70,54 @@ public:
     // primary
     Identifier = -5,
     Number = -6,
+
+    // control flow
+    If = -7,
+    Then = -8,
+    Else = -9,
+    For = -10,
+    In = -11,
   };
 
   double number_value() { return _number_value; };
-  string identifier_string() { return _identifier_string; };
+  string_view identifier_string() { return _identifier; };
   int current_token() { return _current_token; };
 
-  int consume_token() { return _current_token = get_token(); };
+  int consume_token() {
+    if (!_statistics)
+      return _current_token = _buffered ? get_buffer_token() : get_token();
+
+    _statistics->add(Statistics::Counter::Tokens, 1);
+
+    // Reading a file may wait for input, so only the buffer mode is timed
+    if (!_buffered)
+      return _current_token = get_token();
+
+    Statistics::Timer timer(_statistics, Statistics::Phase::Lex);
+    return _current_token = get_buffer_token();
+  };
+
+  void set_statistics(Statistics *statistics) { _statistics = statistics; }
 
   Lexer(FILE *input) : _input(input) {}
-  void reset() { _last_char = ' '; }
+
+  // Reads from the source, which must outlive the lexer.
+  Lexer(string_view source) :
+      _buffered(true), _cursor(source.data()), _end(source.data() + source.size()) {}
+
+  // Reads from the buffer, e.g. a memory-mapped file.
+  Lexer(unique_ptr<llvm::MemoryBuffer> buffer) :
+      _buffered(true),
+      _buffer(move(buffer)),
+      _cursor(_buffer->getBufferStart()),
+      _end(_buffer->getBufferEnd()) {}
+
+  void reset() {
+    _last_char = ' ';
+
+    if (_buffered && _cursor != _end && *_cursor == '\n')
+      _cursor++;
+  }
 
 private:
   int read_char() { return fgetc(_input); }
@@ -48,12 +132,9 @@ private:
       while (isalnum((_last_char = read_char())))
         _identifier_string += _last_char;
 
-      if (_identifier_string == "def")
-        return Token::Def;
-      if (_identifier_string == "extern")
-        return Token::Extern;
+      _identifier = _identifier_string;
 
-      return Token::Identifier;
+      return keyword(_identifier);
     }
 
     if (isdigit(_last_char) || _last_char == '.') {
@@ -88,4 +169,132 @@ private:
 
     return this_char;
   };
+
+  // Returns the keyword's token, or Identifier if it is none.
+  static int keyword(string_view identifier) {
+    if (identifier == "def")
+      return Token::Def;
+    if (identifier == "extern")
+      return Token::Extern;
+    if (identifier == "if")
+      return Token::If;
+    if (identifier == "then")
+      return Token::Then;
+    if (identifier == "else")
+      return Token::Else;
+    if (identifier == "for")
+      return Token::For;
+    if (identifier == "in")
+      return Token::In;
+
+    return Token::Identifier;
+  }
+
+  static uint8_t char_class(char c) { return _char_classes[(uint8_t)c]; }
+
+  // The same as get_token(), but reading from the buffer.
+  int get_buffer_token() {
+    const char *c = _cursor;
+
+    while (c != _end && char_class(*c) & Space)
+      c++;
+
+    if (c == _end) {
+      _cursor = c;
+      return Token::Eof;
+    }
+
+    const char *begin = c;
+
+    if (char_class(*c) & Alpha) {
+      do
+        c++;
+      while (c != _end && char_class(*c) & (Alpha | Digit));
+
+      _cursor = c;
+      _identifier = string_view(begin, c - begin);
+
+      return keyword(_identifier);
+    }
+
+    if (char_class(*c) & (Digit | Dot)) {
+      do
+        c++;
+      while (c != _end && char_class(*c) & (Digit | Dot));
+
+      _cursor = c;
+      _number_value = parse_number(begin, c);
+
+      return Token::Number;
+    }
+
+    if (*c == '#') {
+      while (c != _end && *c != '\n' && *c != '\r')
+        c++;
+
+      _cursor = c;
+      return get_buffer_token();
+    }
+
+    if (*c == '\n') {
+      _cursor = c; // Stay on the newline until reset()
+      return Token::Newline;
+    }
+
+    _cursor = c + 1;
+    return (uint8_t)*c;
+  }
+
+  // Parses a run of digits and dots the way strtod() does, i.e. up to the
+  // second dot, without copying it into a string first.
+  static double parse_number(const char *begin, const char *end) {
+    static constexpr double powers_of_ten[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int fraction_digits = 0;
+    bool fraction = false;
+    const char *c = begin;
+
+    for (; c != end; c++) {
+      if (*c == '.') {
+        if (fraction)
+          break;
+
+        fraction = true;
+        continue;
+      }
+
+      // Leading zeros do not count towards the precision
+      if (mantissa || *c != '0')
+        digits++;
+
+      if (digits > 19)
+        break;
+
+      mantissa = mantissa * 10 + (*c - '0');
+
+      if (fraction)
+        fraction_digits++;
+    }
+
+    // Both the mantissa and the power of ten are exact,
+    // so a single division rounds correctly
+    if (digits <= 19 && mantissa <= (1ull << 53) && fraction_digits <= 22)
+      return (double)mantissa / powers_of_ten[fraction_digits];
+
+    // Too precise for the fast path
+    char text[64];
+    size_t length = end - begin;
+
+    if (length < sizeof(text)) {
+      copy(begin, end, text);
+      text[length] = '\0';
+      return strtod(text, nullptr);
+    }
+
+    return strtod(string(begin, end).c_str(), nullptr);
+  }
 };
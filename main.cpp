@@ -1,25 +1,72 @@
 #include <cstdio>
 
+#include "llvm/Support/TargetSelect.h"
+
+#include "./batch.cpp"
 #include "./lexer.cpp"
+#include "./options.cpp"
 #include "./parser.cpp"
 #include "./repl.cpp"
+#include "./server.cpp"
+#include "./statistics.cpp"
+
+int main(int argc, char **argv) {
+  Options options;
+
+  if (!options.parse(argc, argv))
+    return 1;
+
+  unique_ptr<Statistics> statistics;
+
+  if (options.stats)
+    statistics = std::make_unique<Statistics>();
+
+  // The VM engine does not generate native code
+  if (options.engine == Options::Engine::LLVM) {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+  }
+
+  if (options.script) {
+    // The script is memory-mapped and lexed in place
+    auto input = llvm::MemoryBuffer::getFile(options.script);
 
-int main() {
-  Parser::binop_precedence()->insert_or_assign('>', 10);
-  Parser::binop_precedence()->insert_or_assign('+', 20);
-  Parser::binop_precedence()->insert_or_assign('-', 20);
-  Parser::binop_precedence()->insert_or_assign('*', 40);
+    if (!input) {
+      fprintf(
+          stderr,
+          "Error: cannot open %s: %s\n",
+          options.script,
+          input.getError().message().c_str());
+      return 1;
+    }
 
-  // FILE *input;
-  // fopen_s(&input, "input.txt", "r");
+    Lexer lexer(move(*input));
+    lexer.set_statistics(statistics.get());
+    Parser parser(&lexer);
+    Batch batch(&parser, options, statistics.get());
+
+    int status = batch.run();
+
+    if (statistics) {
+      statistics->print(stderr);
+
+      if (options.stats_json && !statistics->write_json(options.stats_json))
+        status = 1;
+    }
+
+    return status;
+  }
+
+  if (options.socket)
+    return Server(options, statistics.get()).run(options.socket);
 
   Lexer lexer(stdin);
+  lexer.set_statistics(statistics.get());
   Parser parser(&lexer);
-  REPL repl(&parser);
+  REPL repl(&parser, options, statistics.get());
 
   repl.loop();
 
-  // fclose(input);
-
-  return 0;
+  return 1; // EOF!
 };
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Attributes.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/AtomicOrdering.h"
+#include "llvm/Support/MathExtras.h"
+
+using namespace std;
+
+// Makes a pure function look its results up in a table before computing
+// them. The table lives in the function's module, with a fixed number of
+// entries, each keyed on the bit patterns of the arguments; a result
+// replaces the one of other arguments which hash to the same entry.
+//
+// Every entry has a version, odd while the entry is being written, so that
+// any number of threads may call the function: a thread reads an entry, then
+// checks its version is unchanged, and only writes an entry no other thread
+// is writing. Hits and misses are counted in globals of their own.
+class Memoizer {
+public:
+  struct Counters {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+  };
+
+  static string hits_name(llvm::StringRef function) {
+    return function.str() + ".memo.hits";
+  }
+
+  static string misses_name(llvm::StringRef function) {
+    return function.str() + ".memo.misses";
+  }
+
+  // Whether the global is one of a memoized function's counters.
+  static bool counter(const llvm::GlobalValue &value) {
+    return value.getName().endswith(".memo.hits") ||
+        value.getName().endswith(".memo.misses");
+  }
+
+  // Sums the counters of the memoized functions, which are looked up by
+  // their names. Functions without counters are skipped.
+  template <typename Lookup>
+  static Counters read(const vector<string> &functions, Lookup lookup) {
+    Counters counters;
+
+    for (auto &function : functions) {
+      auto *hits = (const uint64_t *)lookup(hits_name(function));
+      auto *misses = (const uint64_t *)lookup(misses_name(function));
+
+      if (!hits || !misses)
+        continue;
+
+      counters.hits += __atomic_load_n(hits, __ATOMIC_RELAXED);
+      counters.misses += __atomic_load_n(misses, __ATOMIC_RELAXED);
+    }
+
+    return counters;
+  }
+
+  // Prints the sums of the counters, read as read() does.
+  template <typename Lookup>
+  static void print(FILE *output, const vector<string> &functions, Lookup lookup) {
+    auto counters = read(functions, lookup);
+
+    fprintf(
+        output,
+        "Memoization: %llu hit(s), %llu miss(es)\n",
+        (unsigned long long)counters.hits,
+        (unsigned long long)counters.misses);
+  }
+
+  // Moves the body of the function into a function of its own, which the
+  // function then only calls on a miss. Recursive calls still go through the
+  // table. The number of entries must be a power of two, at least 2.
+  static void wrap(llvm::Function &function, uint64_t entries) {
+    auto &context = function.getContext();
+    auto &module = *function.getParent();
+    llvm::IRBuilder<> builder(context);
+
+    auto *int64 = builder.getInt64Ty();
+    auto arity = function.arg_size();
+
+    auto *uncached = llvm::Function::Create(
+        function.getFunctionType(),
+        llvm::Function::ExternalLinkage,
+        function.getName() + ".uncached",
+        &module);
+
+    uncached->getBasicBlockList().splice(
+        uncached->end(), function.getBasicBlockList());
+
+    for (auto &arg : function.args()) {
+      auto *moved = uncached->arg_begin() + arg.getArgNo();
+      moved->takeName(&arg);
+      arg.replaceAllUsesWith(moved);
+    }
+
+    // The lookup is not worth inlining, and it refers to globals
+    // of the function's own module
+    function.addFnAttr(llvm::Attribute::NoInline);
+
+    // { version, keys, result }
+    auto *entry_type = llvm::StructType::get(
+        context, {int64, llvm::ArrayType::get(int64, arity), int64});
+    auto *table_type = llvm::ArrayType::get(entry_type, entries);
+
+    auto *table = new llvm::GlobalVariable(
+        module,
+        table_type,
+        false,
+        llvm::GlobalValue::InternalLinkage,
+        llvm::ConstantAggregateZero::get(table_type),
+        function.getName() + ".memo");
+    table->setAlignment(64);
+
+    auto *hits = counter_variable(module, int64, hits_name(function.getName()));
+    auto *misses = counter_variable(module, int64, misses_name(function.getName()));
+
+    auto *entry = llvm::BasicBlock::Create(context, "entry", &function);
+    auto *hit = llvm::BasicBlock::Create(context, "hit", &function);
+    auto *miss = llvm::BasicBlock::Create(context, "miss", &function);
+    auto *lock = llvm::BasicBlock::Create(context, "lock", &function);
+    auto *store = llvm::BasicBlock::Create(context, "store", &function);
+    auto *done = llvm::BasicBlock::Create(context, "done", &function);
+
+    // Hash the arguments' bits into the index of their entry
+    builder.SetInsertPoint(entry);
+    vector<llvm::Value *> args, keys;
+    llvm::Value *hash = builder.getInt64(0);
+
+    for (auto &arg : function.args()) {
+      args.push_back(&arg);
+      keys.push_back(builder.CreateBitCast(&arg, int64));
+      hash = builder.CreateMul(
+          builder.CreateXor(hash, keys.back()), builder.getInt64(0x9e3779b97f4a7c15));
+    }
+
+    auto *index = builder.CreateLShr(hash, 64 - llvm::Log2_64(entries), "index");
+    auto *slot = builder.CreateInBoundsGEP(table, {builder.getInt64(0), index});
+    auto *version_pointer = builder.CreateStructGEP(entry_type, slot, 0);
+    auto *result_pointer = builder.CreateStructGEP(entry_type, slot, 2);
+
+    auto key_pointer = [&](unsigned i) {
+      return builder.CreateInBoundsGEP(
+          slot, {builder.getInt64(0), builder.getInt32(1), builder.getInt64(i)});
+    };
+
+    // Read the entry, then check no thread has written it meanwhile.
+    // Version 0 is an entry never written.
+    auto *version = load(builder, version_pointer, llvm::AtomicOrdering::Acquire);
+    llvm::Value *valid = builder.CreateAnd(
+        builder.CreateICmpNE(version, builder.getInt64(0)),
+        builder.CreateICmpEQ(
+            builder.CreateAnd(version, builder.getInt64(1)), builder.getInt64(0)));
+
+    for (unsigned i = 0; i < arity; i++)
+      valid = builder.CreateAnd(
+          valid,
+          builder.CreateICmpEQ(
+              load(builder, key_pointer(i), llvm::AtomicOrdering::Monotonic), keys[i]));
+
+    auto *cached = load(builder, result_pointer, llvm::AtomicOrdering::Monotonic);
+
+    builder.CreateFence(llvm::AtomicOrdering::Acquire);
+    valid = builder.CreateAnd(
+        valid,
+        builder.CreateICmpEQ(
+            load(builder, version_pointer, llvm::AtomicOrdering::Monotonic), version));
+
+    builder.CreateCondBr(valid, hit, miss);
+
+    builder.SetInsertPoint(hit);
+    increment(builder, hits);
+    builder.CreateRet(builder.CreateBitCast(cached, builder.getDoubleTy()));
+
+    // Compute the result, then store it unless another thread is writing
+    // the entry
+    builder.SetInsertPoint(miss);
+    increment(builder, misses);
+    auto *result = builder.CreateCall(uncached, args, "result");
+    auto *current = load(builder, version_pointer, llvm::AtomicOrdering::Monotonic);
+    builder.CreateCondBr(
+        builder.CreateICmpEQ(
+            builder.CreateAnd(current, builder.getInt64(1)), builder.getInt64(0)),
+        lock,
+        done);
+
+    builder.SetInsertPoint(lock);
+    auto *exchange = builder.CreateAtomicCmpXchg(
+        version_pointer,
+        current,
+        builder.CreateAdd(current, builder.getInt64(1)),
+        llvm::AtomicOrdering::Acquire,
+        llvm::AtomicOrdering::Monotonic);
+    builder.CreateCondBr(builder.CreateExtractValue(exchange, 1), store, done);
+
+    builder.SetInsertPoint(store);
+    builder.CreateFence(llvm::AtomicOrdering::Release);
+
+    for (unsigned i = 0; i < arity; i++)
+      save(builder, keys[i], key_pointer(i), llvm::AtomicOrdering::Monotonic);
+
+    save(
+        builder,
+        builder.CreateBitCast(result, int64),
+        result_pointer,
+        llvm::AtomicOrdering::Monotonic);
+    save(
+        builder,
+        builder.CreateAdd(current, builder.getInt64(2)),
+        version_pointer,
+        llvm::AtomicOrdering::Release);
+    builder.CreateBr(done);
+
+    builder.SetInsertPoint(done);
+    builder.CreateRet(result);
+
+    llvm::verifyFunction(*uncached);
+    llvm::verifyFunction(function);
+  }
+
+private:
+  static llvm::GlobalVariable *
+  counter_variable(llvm::Module &module, llvm::Type *type, const string &name) {
+    auto *variable = new llvm::GlobalVariable(
+        module,
+        type,
+        false,
+        llvm::GlobalValue::ExternalLinkage,
+        llvm::ConstantInt::get(type, 0),
+        name);
+    variable->setAlignment(8);
+
+    return variable;
+  }
+
+  static llvm::Value *
+  load(llvm::IRBuilder<> &builder, llvm::Value *pointer, llvm::AtomicOrdering ordering) {
+    auto *load = builder.CreateAlignedLoad(pointer, 8);
+    load->setAtomic(ordering);
+
+    return load;
+  }
+
+  static void save(
+      llvm::IRBuilder<> &builder,
+      llvm::Value *value,
+      llvm::Value *pointer,
+      llvm::AtomicOrdering ordering) {
+    builder.CreateAlignedStore(value, pointer, 8)->setAtomic(ordering);
+  }
+
+  static void increment(llvm::IRBuilder<> &builder, llvm::Value *counter) {
+    builder.CreateAtomicRMW(
+        llvm::AtomicRMWInst::Add,
+        counter,
+        builder.getInt64(1),
+        llvm::AtomicOrdering::Monotonic);
+  }
+};
@@ -0,0 +1,371 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+
+#include "./statistics.cpp"
+
+using namespace std;
+
+// Memory for the code and data of every module of a JIT, packed together
+// in slabs of mapped pages rather than taking whole pages per module, and
+// returned to the pool once a module is removed.
+//
+// Code and read-only data slabs are mapped twice: writable where objects are
+// loaded, and executable, or only readable, where the code runs. No page is
+// ever writable and executable at once, nor are permissions switched, so one
+// module may be loaded into pages another module is running from.
+class MemoryPool {
+public:
+  enum class Kind { Code, ReadOnly, Data };
+
+  // Memory allocated from the pool: written at its address, and run or read
+  // at its target address, which is the same address for writable data.
+  struct Block {
+    uint8_t *address = nullptr;
+    uint8_t *target = nullptr;
+  };
+
+  struct Usage {
+    uint64_t live = 0;       // Bytes requested
+    uint64_t reserved = 0;   // Bytes of the slabs
+    uint64_t fragmented = 0; // Bytes neither live nor in the largest free blocks
+  };
+
+private:
+  static constexpr uint64_t slab_size = 1024 * 1024;
+
+  struct Slab {
+    uint8_t *address;
+    uint8_t *target;
+    uint64_t size;
+
+    // Free blocks by their addresses, with their sizes. Adjacent free blocks
+    // are merged, so the slab is unused when a single block spans it.
+    map<uintptr_t, uint64_t> free;
+  };
+
+  struct Pool {
+    vector<Slab> slabs;
+    uint64_t live = 0;
+  };
+
+  Pool _pools[3];
+  mutex _mutex;
+
+public:
+  MemoryPool() = default;
+  MemoryPool(const MemoryPool &) = delete;
+
+  ~MemoryPool() {
+    for (auto &pool : _pools)
+      for (auto &slab : pool.slabs)
+        unmap(slab);
+  }
+
+  // Returns memory of the size and alignment, a power of two, or a block
+  // without address if no more memory can be mapped.
+  Block allocate(Kind kind, uint64_t size, uint64_t alignment) {
+    lock_guard<mutex> lock(_mutex);
+    auto &pool = _pools[(int)kind];
+
+    alignment = max<uint64_t>(alignment, 16);
+
+    for (auto &slab : pool.slabs)
+      if (auto block = allocate_from(slab, size, alignment); block.address) {
+        pool.live += size;
+        return block;
+      }
+
+    // Large sections get a slab of their own
+    auto mapped = map_slab(kind, max(slab_size, size + alignment));
+
+    if (!mapped.address)
+      return Block();
+
+    pool.slabs.push_back(move(mapped));
+    pool.live += size;
+
+    return allocate_from(pool.slabs.back(), size, alignment);
+  }
+
+  // Returns the memory, allocated with the same kind and size, to the pool.
+  // Slabs left unused are unmapped, but for one per kind.
+  void free(Kind kind, uint8_t *pointer, uint64_t size) {
+    lock_guard<mutex> lock(_mutex);
+    auto &pool = _pools[(int)kind];
+    auto address = (uintptr_t)pointer;
+
+    pool.live -= size;
+    size = max<uint64_t>(size, 1);
+
+    for (auto slab = pool.slabs.begin(); slab != pool.slabs.end(); slab++) {
+      auto base = (uintptr_t)slab->address;
+
+      if (address < base || address >= base + slab->size)
+        continue;
+
+      auto block = slab->free.emplace(address, size).first;
+
+      // Merge with the following block, then with the preceding one
+      auto next = std::next(block);
+
+      if (next != slab->free.end() && block->first + block->second == next->first) {
+        block->second += next->second;
+        slab->free.erase(next);
+      }
+
+      if (block != slab->free.begin()) {
+        auto previous = std::prev(block);
+
+        if (previous->first + previous->second == block->first) {
+          previous->second += block->second;
+          slab->free.erase(block);
+        }
+      }
+
+      if (slab->free.size() == 1 && slab->free.begin()->second == slab->size &&
+          pool.slabs.size() > 1) {
+        unmap(*slab);
+        pool.slabs.erase(slab);
+      }
+
+      return;
+    }
+  }
+
+  Usage usage() {
+    lock_guard<mutex> lock(_mutex);
+    Usage usage;
+
+    for (auto &pool : _pools) {
+      uint64_t reserved = 0, largest = 0;
+
+      for (auto &slab : pool.slabs) {
+        uint64_t slab_largest = 0;
+
+        for (auto &block : slab.free)
+          slab_largest = max(slab_largest, block.second);
+
+        reserved += slab.size;
+        largest += slab_largest;
+      }
+
+      // Alignment padding and empty sections count as fragmented
+      usage.live += pool.live;
+      usage.reserved += reserved;
+      usage.fragmented += reserved - pool.live - largest;
+    }
+
+    return usage;
+  }
+
+  void print(FILE *output) {
+    auto usage = this->usage();
+
+    fprintf(
+        output,
+        "JIT memory: %.1f KiB live, %.1f KiB fragmented, in %.1f KiB of slabs\n",
+        usage.live / 1024.0,
+        usage.fragmented / 1024.0,
+        usage.reserved / 1024.0);
+  }
+
+private:
+  // Maps the slab, twice but for writable data, or returns one without
+  // address if it cannot be mapped.
+  static Slab map_slab(Kind kind, uint64_t size) {
+    uint64_t page_size = llvm::sys::Process::getPageSize();
+    size = (size + page_size - 1) & ~(page_size - 1);
+
+    if (kind == Kind::Data) {
+      auto *address = mmap(
+          nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+      if (address == MAP_FAILED)
+        return Slab{nullptr, nullptr, 0, {}};
+
+      return Slab{(uint8_t *)address, (uint8_t *)address, size, {{(uintptr_t)address, size}}};
+    }
+
+    // Both views map the same memory, which the file names in /proc/self/maps
+    int file = memfd_create("kaleidoscope-jit", MFD_CLOEXEC);
+
+    if (file < 0)
+      return Slab{nullptr, nullptr, 0, {}};
+
+    void *address = MAP_FAILED, *target = MAP_FAILED;
+
+    if (ftruncate(file, size) == 0) {
+      address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+      target = mmap(
+          nullptr,
+          size,
+          kind == Kind::Code ? PROT_READ | PROT_EXEC : PROT_READ,
+          MAP_SHARED,
+          file,
+          0);
+    }
+
+    close(file);
+
+    if (address == MAP_FAILED || target == MAP_FAILED) {
+      if (address != MAP_FAILED)
+        munmap(address, size);
+
+      if (target != MAP_FAILED)
+        munmap(target, size);
+
+      return Slab{nullptr, nullptr, 0, {}};
+    }
+
+    return Slab{(uint8_t *)address, (uint8_t *)target, size, {{(uintptr_t)address, size}}};
+  }
+
+  static void unmap(const Slab &slab) {
+    munmap(slab.address, slab.size);
+
+    if (slab.target != slab.address)
+      munmap(slab.target, slab.size);
+  }
+
+  // First fit. Splits the free block the memory is taken from.
+  static Block allocate_from(Slab &slab, uint64_t size, uint64_t alignment) {
+    size = max<uint64_t>(size, 1);
+
+    for (auto block = slab.free.begin(); block != slab.free.end(); block++) {
+      auto begin = block->first;
+      auto end = begin + block->second;
+      auto aligned = (begin + alignment - 1) & ~(alignment - 1);
+
+      if (aligned + size > end)
+        continue;
+
+      slab.free.erase(block);
+
+      if (aligned > begin)
+        slab.free.emplace(begin, aligned - begin);
+
+      if (aligned + size < end)
+        slab.free.emplace(aligned + size, end - aligned - size);
+
+      auto offset = aligned - (uintptr_t)slab.address;
+      return {slab.address + offset, slab.target + offset};
+    }
+
+    return Block();
+  }
+};
+
+// Loads an object into memory from the pool, which it gives back either when
+// released, once the object's module is removed, or when destroyed. The
+// RTDyldObjectLinkingLayer keeps every memory manager it has created until
+// the session ends, so the JIT frees code through release().
+//
+// Sections are written at their addresses in the pool, but relocated for
+// their target addresses, where the code runs from.
+class PooledMemoryManager : public llvm::RuntimeDyld::MemoryManager {
+  struct Allocation {
+    MemoryPool::Kind kind;
+    MemoryPool::Block block;
+    uint64_t size;
+  };
+
+  MemoryPool *_pool;
+  vector<Allocation> _allocations;
+  vector<pair<uint8_t *, size_t>> _eh_frames;
+
+  // Only set if statistics are collected, counting the code allocated.
+  Statistics *_statistics;
+
+public:
+  PooledMemoryManager(MemoryPool *pool, Statistics *statistics = nullptr) :
+      _pool(pool), _statistics(statistics) {}
+
+  ~PooledMemoryManager() override { release(); }
+
+  // Frees all the code and data allocated for the object.
+  void release() {
+    deregisterEHFrames();
+
+    for (auto &allocation : _allocations)
+      _pool->free(allocation.kind, allocation.block.address, allocation.size);
+
+    _allocations.clear();
+  }
+
+  uint8_t *allocateCodeSection(
+      uintptr_t size, unsigned alignment, unsigned, llvm::StringRef) override {
+    if (_statistics)
+      _statistics->add(Statistics::Counter::CodeBytes, size);
+
+    return allocate(MemoryPool::Kind::Code, size, alignment);
+  }
+
+  uint8_t *allocateDataSection(
+      uintptr_t size,
+      unsigned alignment,
+      unsigned,
+      llvm::StringRef,
+      bool read_only) override {
+    return allocate(
+        read_only ? MemoryPool::Kind::ReadOnly : MemoryPool::Kind::Data, size, alignment);
+  }
+
+  // Called once the sections are written, before they are relocated.
+  void notifyObjectLoaded(llvm::RuntimeDyld &dyld, const llvm::object::ObjectFile &) override {
+    for (auto &allocation : _allocations)
+      if (allocation.block.target != allocation.block.address)
+        dyld.mapSectionAddress(
+            allocation.block.address, (uintptr_t)allocation.block.target);
+  }
+
+  // The frames are read where they are relocated for.
+  void registerEHFrames(uint8_t *, uint64_t target, size_t size) override {
+    llvm::RTDyldMemoryManager::registerEHFramesInProcess((uint8_t *)target, size);
+    _eh_frames.push_back({(uint8_t *)target, size});
+  }
+
+  void deregisterEHFrames() override {
+    for (auto &frame : _eh_frames)
+      llvm::RTDyldMemoryManager::deregisterEHFramesInProcess(frame.first, frame.second);
+
+    _eh_frames.clear();
+  }
+
+  bool finalizeMemory(string *) override {
+    for (auto &allocation : _allocations)
+      if (allocation.kind == MemoryPool::Kind::Code)
+        llvm::sys::Memory::InvalidateInstructionCache(
+            allocation.block.target, allocation.size);
+
+    return false;
+  }
+
+private:
+  uint8_t *allocate(MemoryPool::Kind kind, uintptr_t size, unsigned alignment) {
+    auto block = _pool->allocate(kind, size, alignment ? alignment : 16);
+
+    if (block.address)
+      _allocations.push_back({kind, block, size});
+
+    return block.address;
+  }
+};
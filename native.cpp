@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+
+// Calls native functions, which take and return doubles, by their addresses.
+// Used by the engines which do not compile the calls themselves.
+namespace Native {
+// Calls with more arguments are not supported.
+constexpr int max_args = 6;
+
+inline double call(uint64_t address, const double *args, int size) {
+  switch (size) {
+  case 0:
+    return ((double (*)())address)();
+  case 1:
+    return ((double (*)(double))address)(args[0]);
+  case 2:
+    return ((double (*)(double, double))address)(args[0], args[1]);
+  case 3:
+    return ((double (*)(double, double, double))address)(
+        args[0], args[1], args[2]);
+  case 4:
+    return ((double (*)(double, double, double, double))address)(
+        args[0], args[1], args[2], args[3]);
+  case 5:
+    return ((double (*)(double, double, double, double, double))address)(
+        args[0], args[1], args[2], args[3], args[4]);
+  default:
+    return ((double (*)(double, double, double, double, double, double))address)(
+        args[0], args[1], args[2], args[3], args[4], args[5]);
+  }
+}
+} // namespace Native
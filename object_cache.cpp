@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+#ifndef KALEIDOSCOPE_VERSION
+#define KALEIDOSCOPE_VERSION "unknown"
+#endif
+
+using namespace std;
+
+// An on-disk cache of compiled objects, keyed by the module's IR and the
+// target it is compiled for. Once the cache grows over its size limit, the
+// oldest objects are removed.
+class ObjectCache {
+  string _directory;
+  uint64_t _size_limit;
+
+  // Everything besides the IR the compiled code depends on.
+  string _target;
+
+  // The total size of the cached objects.
+  uint64_t _size = 0;
+  mutex _size_mutex;
+
+  atomic<size_t> _hits{0};
+  atomic<size_t> _misses{0};
+
+public:
+  // The target describes the code generated besides its IR, e.g. its triple,
+  // CPU and options.
+  ObjectCache(string directory, uint64_t size_limit, const string &target) :
+      _directory(move(directory)),
+      _size_limit(size_limit),
+      _target(
+          target + " LLVM " LLVM_VERSION_STRING " Kaleidoscope " KALEIDOSCOPE_VERSION) {
+    llvm::sys::fs::create_directories(_directory);
+
+    for (auto &entry : entries())
+      _size += entry.size;
+  }
+
+  size_t hits() const { return _hits; }
+  size_t misses() const { return _misses; }
+  uint64_t size() const { return _size; }
+
+  // Returns the key to cache the module's object by.
+  string key(const llvm::Module &module) {
+    string ir;
+    llvm::raw_string_ostream stream(ir);
+    module.print(stream, nullptr);
+    stream.flush();
+
+    llvm::SHA1 hash;
+    hash.update(_target);
+    hash.update(ir);
+
+    return llvm::toHex(hash.final(), /* LowerCase = */ true);
+  }
+
+  // Returns the cached object, or nullptr on a miss.
+  unique_ptr<llvm::MemoryBuffer> load(const string &key) {
+    auto object = llvm::MemoryBuffer::getFile(path(key));
+
+    if (!object) {
+      _misses++;
+      return nullptr;
+    }
+
+    _hits++;
+    return move(*object);
+  }
+
+  // Caches the object, removing the oldest objects if the cache gets too big.
+  void store(const string &key, llvm::MemoryBufferRef object) {
+    // Write to a temporary file first, so that concurrent readers never see
+    // a partially written object
+    int fd;
+    llvm::SmallString<128> temporary_path;
+
+    if (llvm::sys::fs::createUniqueFile(
+            _directory + "/%%%%%%%%.tmp", fd, temporary_path))
+      return;
+
+    {
+      llvm::raw_fd_ostream stream(fd, /* shouldClose = */ true);
+      stream << object.getBuffer();
+    }
+
+    if (llvm::sys::fs::rename(temporary_path, path(key))) {
+      llvm::sys::fs::remove(temporary_path);
+      return;
+    }
+
+    lock_guard<mutex> lock(_size_mutex);
+
+    _size += object.getBufferSize();
+
+    if (_size > _size_limit)
+      evict();
+  }
+
+private:
+  struct Entry {
+    string path;
+    uint64_t size;
+    llvm::sys::TimePoint<> modified;
+  };
+
+  string path(const string &key) const { return _directory + "/" + key + ".o"; }
+
+  // Lists the cached objects.
+  vector<Entry> entries() const {
+    vector<Entry> result;
+    error_code error;
+
+    for (llvm::sys::fs::directory_iterator it(_directory, error), end;
+         it != end && !error;
+         it.increment(error)) {
+      if (llvm::sys::path::extension(it->path()) != ".o")
+        continue;
+
+      if (auto status = it->status())
+        result.push_back(
+            {it->path(), status->getSize(), status->getLastModificationTime()});
+    }
+
+    return result;
+  }
+
+  // Removes the oldest objects until the cache fits into its size limit.
+  void evict() {
+    auto all = entries();
+
+    sort(all.begin(), all.end(), [](const Entry &a, const Entry &b) {
+      return a.modified < b.modified;
+    });
+
+    // Re-count, as other processes may share the directory
+    _size = 0;
+    for (auto &entry : all)
+      _size += entry.size;
+
+    for (auto &entry : all) {
+      if (_size <= _size_limit)
+        break;
+
+      if (!llvm::sys::fs::remove(entry.path))
+        _size -= entry.size;
+    }
+  }
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+
+#include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/IR/GlobalValue.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+
+#include "./statistics.cpp"
+
+using namespace std;
+
+// Optimizes whole modules on the new pass manager, at one of the -O0..-O3
+// levels. Optimizing a module at once lets optimizations work across
+// function boundaries, e.g. inline callees into their callers.
+//
+// From -O2, the default pipeline also optimizes the loops of for expressions:
+// it rotates them, hoists invariant code out of them (LICM), and unrolls and
+// vectorizes them.
+class Optimizer {
+  unsigned _level;
+
+  // Lets the passes query the target, e.g. for the vector width. May be null.
+  unique_ptr<llvm::TargetMachine> _target_machine;
+
+  // Only set if statistics are collected, including the time of every pass.
+  Statistics *_statistics;
+
+public:
+  Optimizer(
+      unsigned level,
+      unique_ptr<llvm::TargetMachine> target_machine,
+      Statistics *statistics = nullptr) :
+      _level(level),
+      _target_machine(move(target_machine)),
+      _statistics(statistics) {}
+
+  unsigned level() const { return _level; }
+
+  // Optimize the module. If given, functions which are not preserved are made
+  // internal, so that they can be specialized, inlined into their callers and
+  // removed once unused.
+  void optimize(
+      llvm::Module &module,
+      function<bool(const llvm::GlobalValue &)> preserve = nullptr) {
+    Statistics::Timer timer(_statistics, Statistics::Phase::Optimization);
+    llvm::PassInstrumentationCallbacks callbacks;
+
+    if (_statistics) {
+      _statistics->add(Statistics::Counter::InstructionsBefore, instructions(module));
+      _statistics->time_passes(callbacks);
+    }
+
+    llvm::LoopAnalysisManager lam;
+    llvm::FunctionAnalysisManager fam;
+    llvm::CGSCCAnalysisManager cgam;
+    llvm::ModuleAnalysisManager mam;
+
+    llvm::PassBuilder pb(_target_machine.get(), llvm::None, &callbacks);
+    pb.registerModuleAnalyses(mam);
+    pb.registerCGSCCAnalyses(cgam);
+    pb.registerFunctionAnalyses(fam);
+    pb.registerLoopAnalyses(lam);
+    pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+    llvm::ModulePassManager mpm;
+
+    if (preserve)
+      mpm.addPass(llvm::InternalizePass(move(preserve)));
+
+    // -O0 only inlines what must be inlined, for the fastest turnaround
+    if (_level == 0)
+      mpm.addPass(llvm::AlwaysInlinerPass());
+    else
+      mpm.addPass(pb.buildPerModuleDefaultPipeline(optimization_level()));
+
+    mpm.run(module, mam);
+
+    if (_statistics)
+      _statistics->add(Statistics::Counter::InstructionsAfter, instructions(module));
+  }
+
+private:
+  static uint64_t instructions(const llvm::Module &module) {
+    uint64_t count = 0;
+
+    for (auto &function : module)
+      count += function.getInstructionCount();
+
+    return count;
+  }
+
+  llvm::PassBuilder::OptimizationLevel optimization_level() const {
+    switch (_level) {
+    case 1:
+      return llvm::PassBuilder::OptimizationLevel::O1;
+    case 2:
+      return llvm::PassBuilder::OptimizationLevel::O2;
+    default:
+      return llvm::PassBuilder::OptimizationLevel::O3;
+    }
+  }
+};
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Options of a session, set from the command line.
+struct Options {
+  enum class Engine {
+    LLVM, // Compile to native code
+    VM,   // Compile to bytecode, run by a virtual machine
+  };
+
+  // The engine functions are compiled and run by.
+  Engine engine = Engine::LLVM;
+
+  // Compile function bodies on their first call rather than on definition.
+  bool lazy = false;
+
+  // The optimization level, from -O0 to -O3.
+  unsigned level = 2;
+
+  // Compile functions quickly first, then recompile them at full optimization
+  // once they have been called hot_threshold times.
+  bool tiered = false;
+  uint64_t hot_threshold = 1000;
+
+  // Let functions be defined again, replacing their code. Callers are not
+  // recompiled, and see the new definition.
+  bool redefinable = false;
+
+  // Top-level expressions with at most this many nodes are interpreted
+  // rather than compiled. 0 compiles every expression.
+  size_t interpret_limit = 32;
+
+  // Floating-point semantics traded for speed, as LLVM's fast-math flags.
+  // Arithmetic is strict IEEE unless any is set.
+  enum FastMath : unsigned {
+    Reassociate = 1 << 0,          // reassoc: reorder operations
+    Contract = 1 << 1,             // contract: fuse multiplies and adds into FMAs
+    NoNaNs = 1 << 2,               // nnan: assume no operand nor result is NaN
+    NoInfs = 1 << 3,               // ninf: ditto, infinite
+    NoSignedZeros = 1 << 4,        // nsz: ignore the sign of zeros
+    ApproximateFunctions = 1 << 5, // afn: approximate libm functions
+    Fast = (1 << 6) - 1,           // fast: all of them
+  };
+
+  unsigned fast_math = 0;
+
+  // Call math externs, e.g. sin or sqrt, through LLVM intrinsics, which can
+  // be constant folded and vectorized, rather than as opaque functions.
+  bool math_intrinsics = false;
+
+  // Memoize the results of pure functions, in tables of memo_entries entries
+  // per function, a power of two.
+  bool memoize = false;
+  uint64_t memo_entries = 4096;
+
+  // Name the functions of JIT code for perf, in /tmp/perf-<pid>.map and, if
+  // LLVM is built with perf support, in jitdump files.
+  bool perf = false;
+
+  // Register JIT code with GDB, for it to name functions and step into them.
+  bool gdb = false;
+
+  // A directory to cache compiled objects in, if any.
+  const char *cache = nullptr;
+
+  // The size limit of the object cache, in megabytes.
+  uint64_t cache_limit = 256;
+
+  // A UNIX socket to serve sessions on instead of reading stdin, if any.
+  const char *socket = nullptr;
+
+  // A script to compile as a whole instead of running the interactive loop.
+  const char *script = nullptr;
+
+  // An object file to compile the script into instead of running it.
+  const char *output = nullptr;
+
+  // Compile the object file for the host's CPU rather than a generic one of
+  // its architecture, so that it may not run on other CPUs.
+  bool native = false;
+
+  // The number of threads compiling a script to run.
+  unsigned jobs = 1;
+
+  // Print the time spent in every phase, and what they processed, on exit.
+  bool stats = false;
+
+  // A file to also write the statistics to as JSON, if any. Implies stats.
+  const char *stats_json = nullptr;
+
+  // Parse the command line. Returns false on an unrecognized argument,
+  // or on options which cannot be combined.
+  bool parse(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+      if (!strcmp(argv[i], "--engine=llvm"))
+        engine = Engine::LLVM;
+      else if (!strcmp(argv[i], "--engine=vm"))
+        engine = Engine::VM;
+      else if (!strcmp(argv[i], "--lazy"))
+        lazy = true;
+      else if (!strncmp(argv[i], "-O", 2) && strlen(argv[i]) == 3 &&
+               argv[i][2] >= '0' && argv[i][2] <= '3')
+        level = argv[i][2] - '0';
+      else if (!strcmp(argv[i], "--tiered"))
+        tiered = true;
+      else if (!strcmp(argv[i], "--redefinable"))
+        redefinable = true;
+      else if (auto value = value_of(argv[i], "--hot-threshold="))
+        hot_threshold = strtoull(value, nullptr, 10);
+      else if (auto value = value_of(argv[i], "--interpret-limit="))
+        interpret_limit = strtoull(value, nullptr, 10);
+      else if (!strcmp(argv[i], "--fast-math"))
+        fast_math = Fast;
+      else if (auto value = value_of(argv[i], "--fast-math=")) {
+        if (!parse_fast_math(value))
+          return false;
+      }
+      else if (!strcmp(argv[i], "--math-intrinsics"))
+        math_intrinsics = true;
+      else if (!strcmp(argv[i], "--memoize"))
+        memoize = true;
+      else if (auto value = value_of(argv[i], "--memo-entries="))
+        memo_entries = strtoull(value, nullptr, 10);
+      else if (!strcmp(argv[i], "--perf"))
+        perf = true;
+      else if (!strcmp(argv[i], "--gdb"))
+        gdb = true;
+      else if (auto value = value_of(argv[i], "--cache="))
+        cache = value;
+      else if (auto value = value_of(argv[i], "--cache-limit="))
+        cache_limit = strtoull(value, nullptr, 10);
+      else if (auto value = value_of(argv[i], "--socket="))
+        socket = value;
+      else if (auto value = value_of(argv[i], "--script="))
+        script = value;
+      else if (auto value = value_of(argv[i], "--output="))
+        output = value;
+      else if (!strcmp(argv[i], "--native"))
+        native = true;
+      else if (auto value = value_of(argv[i], "--jobs="))
+        jobs = strtoul(value, nullptr, 10);
+      else if (!strcmp(argv[i], "--stats"))
+        stats = true;
+      else if (auto value = value_of(argv[i], "--stats-json=")) {
+        stats = true;
+        stats_json = value;
+      }
+      else {
+        fprintf(stderr, "Error: unknown option %s\n", argv[i]);
+        return false;
+      }
+    }
+
+    return check();
+  }
+
+  // Check that the options can be combined. Prints why not, by the command
+  // line arguments setting them, and returns false if they cannot.
+  bool check() const {
+    if (output && !script) {
+      fprintf(stderr, "Error: --output requires --script\n");
+      return false;
+    }
+
+    if (native && !output) {
+      fprintf(stderr, "Error: --native requires --output\n");
+      return false;
+    }
+
+    if (jobs < 1 || (jobs > 1 && (!script || output))) {
+      fprintf(stderr, "Error: --jobs requires --script and no --output\n");
+      return false;
+    }
+
+    if (tiered && (lazy || script)) {
+      fprintf(stderr, "Error: --tiered cannot be combined with --lazy or --script\n");
+      return false;
+    }
+
+    if (engine == Engine::VM &&
+        (lazy || tiered || cache || script || memoize || fast_math || math_intrinsics ||
+         perf || gdb)) {
+      fprintf(
+          stderr,
+          "Error: --engine=vm cannot be combined with --lazy, --tiered, "
+          "--cache, --script, --memoize, --fast-math, --math-intrinsics, "
+          "--perf or --gdb\n");
+      return false;
+    }
+
+    // Recompiling a memoized function would define its table again
+    if (memoize && tiered) {
+      fprintf(stderr, "Error: --memoize cannot be combined with --tiered\n");
+      return false;
+    }
+
+    // Callers would keep inlined or memoized results of earlier definitions
+    if (redefinable && (lazy || tiered || memoize || script)) {
+      fprintf(
+          stderr,
+          "Error: --redefinable cannot be combined with --lazy, --tiered, "
+          "--memoize or --script\n");
+      return false;
+    }
+
+    // Stubs are named after their functions, which sessions may share
+    if (socket && (script || tiered || redefinable)) {
+      fprintf(
+          stderr,
+          "Error: --socket cannot be combined with --script, --tiered "
+          "or --redefinable\n");
+      return false;
+    }
+
+    if (memo_entries < 2 || (memo_entries & (memo_entries - 1))) {
+      fprintf(stderr, "Error: --memo-entries must be a power of two, at least 2\n");
+      return false;
+    }
+
+    if (hot_threshold < 1) {
+      fprintf(stderr, "Error: --hot-threshold must be positive\n");
+      return false;
+    }
+
+    return true;
+  }
+
+private:
+  // Parse a comma-separated list of fast-math flags, by their LLVM names.
+  bool parse_fast_math(const char *value) {
+    static const struct {
+      const char *name;
+      unsigned flags;
+    } names[] = {
+        {"reassoc", Reassociate},
+        {"contract", Contract},
+        {"nnan", NoNaNs},
+        {"ninf", NoInfs},
+        {"nsz", NoSignedZeros},
+        {"afn", ApproximateFunctions},
+        {"fast", Fast},
+        {"strict", 0},
+    };
+
+    fast_math = 0;
+
+    while (*value) {
+      size_t length = strcspn(value, ",");
+      bool found = false;
+
+      for (auto &name : names)
+        if (strlen(name.name) == length && !strncmp(value, name.name, length)) {
+          fast_math |= name.flags;
+          found = true;
+        }
+
+      if (!found) {
+        fprintf(stderr, "Error: unknown fast-math flag %.*s\n", (int)length, value);
+        return false;
+      }
+
+      value += length;
+
+      if (*value == ',')
+        value++;
+    }
+
+    return true;
+  }
+
+  // Returns the value of a "--name=value" argument, or nullptr if the argument
+  // has another name.
+  static const char *value_of(const char *argument, const char *prefix) {
+    size_t length = strlen(prefix);
+
+    if (strncmp(argument, prefix, length))
+      return nullptr;
+
+    return argument + length;
+  }
+};
@@ -1,44 +1,63 @@
 #pragma once
 
+#include "./ast/arena.cpp"
 #include "./ast/expression/binary.cpp"
 #include "./ast/expression/call.cpp"
+#include "./ast/expression/for.cpp"
+#include "./ast/expression/if.cpp"
 #include "./ast/expression/number.cpp"
 #include "./ast/expression/variable.cpp"
 #include "./ast/function.cpp"
 #include "./ast/prototype.cpp"
+#include "./ast/symbol.cpp"
+#include "./diagnostics.cpp"
 #include "lexer.cpp"
 
 #include <map>
-#include <memory>
+#include <vector>
 
 using namespace std;
 
 class Parser {
   Lexer *_lexer;
-  static map<char, int> _binop_precedence;
 
- public:
-  // Static getters
-  //
+  // Binary operators and their precedences, 1 being the lowest.
+  // Every parser has its own, so that sessions do not share them.
+  map<char, int> _binop_precedence = {{'<', 10}, {'+', 20}, {'-', 20}, {'*', 40}};
+
+  // Nodes are allocated from the arena, which is reset once they are used.
+  // Names are interned into the symbol table, which lives for the session.
+  AST::Arena _arena;
+  AST::SymbolTable _symbols;
 
-  static map<char, int> *binop_precedence() { return &_binop_precedence; };
+  // Call arguments and prototype arguments being parsed,
+  // copied into the arena once their number is known.
+  vector<AST::Expression::Base *> _args_stack;
+  vector<AST::Symbol> _arg_names;
 
+ public:
   // Instance getters
   //
 
+  map<char, int> *binop_precedence() { return &_binop_precedence; };
   Lexer *lexer() { return _lexer; };
+  AST::Arena *arena() { return &_arena; };
+  AST::SymbolTable *symbols() { return &_symbols; };
 
   // Constructors
   //
 
   Parser(Lexer *lexer) : _lexer(lexer) {}
 
-  static unique_ptr<AST::Expression::Base> log_error(const char *string) {
-    fprintf(stderr, "Error: %s\n", string);
+  // Parse another input, keeping the symbols interned so far.
+  void set_lexer(Lexer *lexer) { _lexer = lexer; }
+
+  static AST::Expression::Base *log_error(const char *string) {
+    fprintf(Diagnostics::output, "Error: %s\n", string);
     return nullptr;
   }
 
-  static unique_ptr<AST::Prototype> log_prototype_error(const char *string) {
+  static AST::Prototype *log_prototype_error(const char *string) {
     log_error(string);
     return nullptr;
   }
@@ -47,19 +66,19 @@ class Parser {
   int get_current_token_binop_precedence() {
     if (!isascii(_lexer->current_token())) return -1;
 
-    int token_precedence = this->_binop_precedence[_lexer->current_token()];
-    if (token_precedence <= 0) return -1;
+    auto token_precedence = _binop_precedence.find(_lexer->current_token());
+    if (token_precedence == _binop_precedence.end() || token_precedence->second <= 0) return -1;
 
-    return token_precedence;
+    return token_precedence->second;
   }
 
-  unique_ptr<AST::Expression::Base> parse_number_expression() {
-    auto result = make_unique<AST::Expression::Number>(_lexer->number_value());
+  AST::Expression::Base *parse_number_expression() {
+    auto result = _arena.make<AST::Expression::Number>(_lexer->number_value());
     _lexer->consume_token();  // Consume the number
-    return move(result);
+    return result;
   }
 
-  unique_ptr<AST::Expression::Base> parse_parenthesis_expression() {
+  AST::Expression::Base *parse_parenthesis_expression() {
     _lexer->consume_token();  // Consume "("
 
     auto e = parse_expression();
@@ -74,29 +93,34 @@ class Parser {
   }
 
   // Returns either AST::Expression::Variable or AST::Expression::Call.
-  unique_ptr<AST::Expression::Base> parse_identifier_expression() {
-    string identifier_name = _lexer->identifier_string();
+  AST::Expression::Base *parse_identifier_expression() {
+    auto identifier_name = _symbols.intern(_lexer->identifier_string());
 
     _lexer->consume_token();  // Consume the identifier
 
     // If there is no "(", then that's a simple identifier, not a function call
     if (_lexer->current_token() != '(')
-      return make_unique<AST::Expression::Variable>(identifier_name);
+      return _arena.make<AST::Expression::Variable>(identifier_name);
 
-    // Otherwise it's a function call
+    // Otherwise it's a function call. Nested calls push their arguments
+    // above ours, and pop them before we continue
     _lexer->consume_token();  // Consume '('
-    vector<unique_ptr<AST::Expression::Base>> args;
+    size_t args_begin = _args_stack.size();
     if (_lexer->current_token() != ')') {
       while (1) {
         if (auto arg = parse_expression())
-          args.push_back(move(arg));
-        else
+          _args_stack.push_back(arg);
+        else {
+          pop_args(args_begin);
           return nullptr;
+        }
 
         if (_lexer->current_token() == ')') break;
 
-        if (_lexer->current_token() != ',')
+        if (_lexer->current_token() != ',') {
+          pop_args(args_begin);
           return this->log_error("Expected ')' or ',' in the arguments list");
+        }
 
         _lexer->consume_token();  // Consume the token
       }
@@ -104,10 +128,14 @@ class Parser {
 
     _lexer->consume_token();
 
-    return make_unique<AST::Expression::Call>(identifier_name, move(args));
+    int args_size = _args_stack.size() - args_begin;
+    auto args = _arena.make_array(_args_stack.data() + args_begin, args_size);
+    pop_args(args_begin);
+
+    return _arena.make<AST::Expression::Call>(identifier_name, args, args_size);
   }
 
-  unique_ptr<AST::Expression::Base> parse_primary_expression() {
+  AST::Expression::Base *parse_primary_expression() {
     int ct = _lexer->current_token();
 
     switch (_lexer->current_token()) {
@@ -119,19 +147,96 @@ class Parser {
         return this->parse_number_expression();
       case '(':
         return this->parse_parenthesis_expression();
+      case Lexer::Token::If:
+        return this->parse_if_expression();
+      case Lexer::Token::For:
+        return this->parse_for_expression();
+    }
+  }
+
+  // if condition then expression else expression
+  AST::Expression::Base *parse_if_expression() {
+    _lexer->consume_token();  // Consume 'if'
+
+    auto condition = parse_expression();
+    if (!condition) return nullptr;
+
+    if (_lexer->current_token() != Lexer::Token::Then)
+      return this->log_error("Expected 'then'");
+
+    _lexer->consume_token();  // Consume 'then'
+
+    auto then = parse_expression();
+    if (!then) return nullptr;
+
+    if (_lexer->current_token() != Lexer::Token::Else)
+      return this->log_error("Expected 'else'");
+
+    _lexer->consume_token();  // Consume 'else'
+
+    auto otherwise = parse_expression();
+    if (!otherwise) return nullptr;
+
+    return _arena.make<AST::Expression::If>(condition, then, otherwise);
+  }
+
+  // for identifier = expression, expression [, expression] in expression
+  AST::Expression::Base *parse_for_expression() {
+    _lexer->consume_token();  // Consume 'for'
+
+    if (_lexer->current_token() != Lexer::Token::Identifier)
+      return this->log_error("Expected identifier after 'for'");
+
+    auto variable = _symbols.intern(_lexer->identifier_string());
+    _lexer->consume_token();  // Consume the identifier
+
+    if (_lexer->current_token() != '=')
+      return this->log_error("Expected '=' after the 'for' variable");
+
+    _lexer->consume_token();  // Consume '='
+
+    auto start = parse_expression();
+    if (!start) return nullptr;
+
+    if (_lexer->current_token() != ',')
+      return this->log_error("Expected ',' after the 'for' start value");
+
+    _lexer->consume_token();  // Consume ','
+
+    auto end = parse_expression();
+    if (!end) return nullptr;
+
+    // The step is optional
+    AST::Expression::Base *step = nullptr;
+
+    if (_lexer->current_token() == ',') {
+      _lexer->consume_token();  // Consume ','
+
+      step = parse_expression();
+      if (!step) return nullptr;
     }
+
+    if (_lexer->current_token() != Lexer::Token::In)
+      return this->log_error("Expected 'in' after 'for'");
+
+    _lexer->consume_token();  // Consume 'in'
+
+    auto body = parse_expression();
+    if (!body) return nullptr;
+
+    return _arena.make<AST::Expression::For>(variable, start, end, step, body);
   }
 
-  unique_ptr<AST::Expression::Base> parse_expression() {
+  AST::Expression::Base *parse_expression() {
     auto lhs = parse_primary_expression();
 
     if (!lhs) return nullptr;
 
-    return parse_binop_rhs(0, move(lhs));
+    return parse_binop_rhs(0, lhs);
   }
 
-  unique_ptr<AST::Expression::Base> parse_binop_rhs(
-      int precedence, unique_ptr<AST::Expression::Base> lhs) {
+  AST::Expression::Base *parse_binop_rhs(
+      int precedence, AST::Expression::Base *lhs) {
     while (1) {
       int token_precedence = get_current_token_binop_precedence();
 
@@ -145,62 +250,65 @@ class Parser {
 
       int next_precedence = get_current_token_binop_precedence();
       if (token_precedence < next_precedence) {
-        rhs = parse_binop_rhs(token_precedence + 1, move(rhs));
+        rhs = parse_binop_rhs(token_precedence + 1, rhs);
 
         if (!rhs) return nullptr;
       }
 
-      lhs = make_unique<AST::Expression::Binary>(binop, move(lhs), move(rhs));
+      lhs = _arena.make<AST::Expression::Binary>(binop, lhs, rhs);
     }
   }
 
-  unique_ptr<AST::Prototype> parse_function_prototype() {
+  AST::Prototype *parse_function_prototype() {
     if (_lexer->current_token() != Lexer::Token::Identifier)
       return this->log_prototype_error("Expected function name in prototype");
 
-    string function_name = _lexer->identifier_string();
+    auto function_name = _symbols.intern(_lexer->identifier_string());
     _lexer->consume_token();
 
     if (_lexer->current_token() != '(')
       return this->log_prototype_error("Expected '(' in prototype");
 
-    vector<string> argument_names;
+    _arg_names.clear();
     while (_lexer->consume_token() == Lexer::Token::Identifier)
-      argument_names.push_back(_lexer->identifier_string());
+      _arg_names.push_back(_symbols.intern(_lexer->identifier_string()));
 
     if (_lexer->current_token() != ')')
       return this->log_prototype_error("Expected ')' in prototype");
 
     _lexer->consume_token();  // Consume ')'
 
-    return make_unique<AST::Prototype>(function_name, move(argument_names));
+    auto args = _arena.make_array(_arg_names.data(), _arg_names.size());
+    return _arena.make<AST::Prototype>(function_name, args, _arg_names.size());
   }
 
-  unique_ptr<AST::Function> parse_function_definition() {
+  AST::Function *parse_function_definition() {
     _lexer->consume_token();  // Consume 'def'
 
     auto proto = parse_function_prototype();
     if (!proto) return nullptr;
 
     if (auto expression = parse_expression())
-      return make_unique<AST::Function>(move(proto), move(expression));
+      return _arena.make<AST::Function>(proto, expression);
 
     return nullptr;
   }
 
-  unique_ptr<AST::Prototype> parse_extern() {
+  AST::Prototype *parse_extern() {
     _lexer->consume_token();  // Consume 'extern'
     return parse_function_prototype();
   }
 
-  unique_ptr<AST::Function> parse_top_level_expression() {
+  AST::Function *parse_top_level_expression() {
     if (auto expression = parse_expression()) {
-      auto proto = make_unique<AST::Prototype>("", vector<string>());
-      return make_unique<AST::Function>(move(proto), move(expression));
+      auto proto = _arena.make<AST::Prototype>(
+          _symbols.intern("__anon_expr"), nullptr, 0);
+      return _arena.make<AST::Function>(proto, expression);
     }
 
     return nullptr;
   }
-};
 
-map<char, int> Parser::_binop_precedence;
+ private:
+  void pop_args(size_t args_begin) { _args_stack.resize(args_begin); }
+};
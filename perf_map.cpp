@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cinttypes>
+#include <cstdio>
+#include <mutex>
+
+#include <unistd.h>
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Error.h"
+
+using namespace std;
+
+// Writes /tmp/perf-<pid>.map, which perf reads to name the functions of JIT
+// code in its reports: a line per function, with its address, size and name.
+// Every JIT of the process shares the map, as they share the process.
+//
+// The format cannot tell that code was freed, so should a later function be
+// loaded where a freed one was, perf may report it under either name.
+class PerfMap : public llvm::JITEventListener {
+  FILE *_file;
+  mutex _mutex;
+
+  PerfMap(FILE *file) : _file(file) {}
+
+public:
+  PerfMap(const PerfMap &) = delete;
+
+  ~PerfMap() override {
+    if (_file)
+      fclose(_file);
+  }
+
+  // The map of the process, or nullptr if it cannot be written.
+  static PerfMap *get() {
+    static PerfMap map([]() {
+      char path[64];
+      snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+
+      auto *file = fopen(path, "w");
+
+      if (!file)
+        fprintf(stderr, "Error: cannot write %s\n", path);
+
+      return file;
+    }());
+
+    return map._file ? &map : nullptr;
+  }
+
+  void notifyObjectLoaded(
+      ObjectKey,
+      const llvm::object::ObjectFile &object,
+      const llvm::RuntimeDyld::LoadedObjectInfo &info) override {
+    // The debug object has the addresses the sections are loaded at
+    auto debug_object = info.getObjectForDebug(object);
+
+    if (!debug_object.getBinary())
+      return;
+
+    lock_guard<mutex> lock(_mutex);
+
+    for (auto &symbol : llvm::object::computeSymbolSizes(*debug_object.getBinary())) {
+      auto type = symbol.first.getType();
+
+      if (!type) {
+        llvm::consumeError(type.takeError());
+        continue;
+      }
+
+      if (*type != llvm::object::SymbolRef::ST_Function)
+        continue;
+
+      auto name = symbol.first.getName();
+      auto address = symbol.first.getAddress();
+
+      if (!name || !address) {
+        llvm::consumeError(name.takeError());
+        llvm::consumeError(address.takeError());
+        continue;
+      }
+
+      fprintf(
+          _file,
+          "%" PRIx64 " %" PRIx64 " %s\n",
+          *address,
+          symbol.second,
+          name->str().c_str());
+    }
+
+    fflush(_file);
+  }
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "./ast/expression/binary.cpp"
+#include "./ast/expression/call.cpp"
+#include "./ast/expression/number.cpp"
+#include "./ast/expression/variable.cpp"
+#include "./ast/expression/visitor.cpp"
+#include "./ast/function.cpp"
+#include "./ast/symbol.cpp"
+
+using namespace std;
+
+// Tells which functions are pure: their result only depends on their
+// arguments, and calling them has no side effect. Expressions have no side
+// effects of their own, so a definition is pure unless it calls an extern
+// which is not known to be pure, or a function which is not.
+class Purity {
+  class Checker : public AST::Expression::Visitor<Checker, bool> {
+    const Purity *_purity;
+    AST::Symbol _self;
+
+  public:
+    Checker(const Purity *purity, AST::Symbol self) : _purity(purity), _self(self) {}
+
+    using Visitor::visit;
+
+    bool visit(AST::Expression::Binary *node) {
+      return visit(node->lhs()) && visit(node->rhs());
+    }
+
+    bool visit(AST::Expression::Call *node) {
+      if (node->callee() != _self && !_purity->pure(node->callee()))
+        return false;
+
+      for (int i = 0; i < node->args_size(); i++)
+        if (!visit(node->arg(i)))
+          return false;
+
+      return true;
+    }
+
+    bool visit(AST::Expression::Number *) { return true; }
+    bool visit(AST::Expression::Variable *) { return true; }
+
+    bool visit(AST::Expression::If *node) {
+      return visit(node->condition()) && visit(node->then()) &&
+          visit(node->otherwise());
+    }
+
+    bool visit(AST::Expression::For *node) {
+      return visit(node->start()) && visit(node->end()) &&
+          (!node->step() || visit(node->step())) && visit(node->body());
+    }
+  };
+
+  // Whether every definition checked so far is pure, by its name.
+  unordered_map<AST::Symbol, bool> _definitions;
+
+  // The C library functions which are pure, errno aside.
+  inline static const unordered_set<string> _externs = {
+      "acos", "asin", "atan",  "atan2", "cbrt", "ceil",  "cos",  "cosh",
+      "exp",  "exp2", "fabs",  "floor", "fmax", "fmin",  "fmod", "hypot",
+      "log",  "log2", "log10", "pow",   "round", "sin",  "sinh", "sqrt",
+      "tan",  "tanh", "trunc"};
+
+public:
+  // Checks the definition, remembering whether it is pure for the functions
+  // which call it. A function may call itself. Returns whether it is pure.
+  bool check(AST::Function *node) {
+    auto name = node->prototype()->name();
+    return _definitions[name] = Checker(this, name).visit(node->body());
+  }
+
+  // Whether the function is known to be pure: either a definition checked
+  // to be, or a pure extern.
+  bool pure(AST::Symbol name) const {
+    auto definition = _definitions.find(name);
+
+    if (definition != _definitions.end())
+      return definition->second;
+
+    return _externs.count(name.str());
+  }
+
+  // The names of the pure definitions.
+  vector<string> definitions() const {
+    vector<string> names;
+
+    for (auto &definition : _definitions)
+      if (definition.second)
+        names.push_back(definition.first.str());
+
+    return names;
+  }
+};
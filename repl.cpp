@@ -1,60 +1,143 @@
+#pragma once
+
 #include <cstdio>
 #include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
 
 #include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/Error.h"
 #include "llvm/Support/raw_ostream.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 
 #include "./codegen.cpp"
+#include "./diagnostics.cpp"
+#include "./frontend.cpp"
+#include "./inline_library.cpp"
+#include "./interpreter.cpp"
 #include "./jit.cpp"
+#include "./memoizer.cpp"
+#include "./optimizer.cpp"
+#include "./options.cpp"
 #include "./parser.cpp"
+#include "./purity.cpp"
+#include "./statistics.cpp"
+#include "./vm/machine.cpp"
 
 using namespace std;
 
 class REPL {
   Parser *_parser;
+  Options _options;
+
+  // Only set if statistics are collected.
+  Statistics *_statistics;
+  Frontend _frontend;
+
+  // The JIT may be shared with other sessions, each adding its modules to a
+  // dylib of its own, and generating them in a context of its own.
+  unique_ptr<JIT> _owned_jit;
+  JIT *_jit = nullptr;
+  llvm::orc::JITDylib *_dylib = nullptr;
+  llvm::orc::ThreadSafeContext _context;
+
+  // The modules of the definitions, removed with the session from a shared JIT.
+  vector<llvm::orc::VModuleKey> _keys;
+
+  // Where results are printed. Errors go to Diagnostics::output.
+  FILE *_output;
 
-  unique_ptr<JIT> _jit;
-  unique_ptr<llvm::LLVMContext> _context;
   unique_ptr<llvm::Module> _module;
   unique_ptr<Codegen> _codegen;
   unique_ptr<llvm::IRBuilder<>> _builder;
-  unique_ptr<llvm::legacy::FunctionPassManager> _fpm;
+  unique_ptr<Optimizer> _optimizer;
+  unique_ptr<InlineLibrary> _inline_library;
+  unique_ptr<Interpreter> _interpreter;
+  Purity _purity;
+
+  // Only set with the VM engine, instead of all the above.
+  unique_ptr<VM::Machine> _machine;
 
 public:
-  REPL(Parser *parser) : _parser(parser) {
-    _context = std::make_unique<llvm::LLVMContext>();
-    _builder = std::make_unique<llvm::IRBuilder<>>(*_context);
-    _module = std::make_unique<llvm::Module>("REPL", *_context);
-
-    // Initialize the Function Pass Manager. Currently using the legacy one
-    _fpm = std::make_unique<llvm::legacy::FunctionPassManager>(_module.get());
-    _fpm->add(llvm::createInstructionCombiningPass());
-    _fpm->add(llvm::createReassociatePass());
-    _fpm->add(llvm::createGVNPass());
-    _fpm->add(llvm::createCFGSimplificationPass());
-    _fpm->doInitialization();
-
-    _codegen = std::make_unique<Codegen>(
-        Codegen(_context.get(), _module.get(), _builder.get(), _fpm.get()));
+  // Creates a JIT of its own unless one is given, along with the dylib to add
+  // the session's modules to, e.g. by a server.
+  REPL(
+      Parser *parser,
+      const Options &options,
+      Statistics *statistics = nullptr,
+      FILE *output = stdout,
+      JIT *jit = nullptr,
+      llvm::orc::JITDylib *dylib = nullptr) :
+      _parser(parser),
+      _options(options),
+      _statistics(statistics),
+      _frontend(parser, statistics),
+      _jit(jit),
+      _dylib(dylib),
+      _context(std::make_unique<llvm::LLVMContext>()),
+      _output(output) {
+    if (_options.engine == Options::Engine::VM) {
+      _machine = std::make_unique<VM::Machine>(_options.redefinable);
+      return;
+    }
+
+    if (!_jit) {
+      _owned_jit = llvm::cantFail(JIT::Create(_options, _statistics));
+      _jit = _owned_jit.get();
+    }
+
+    auto &context = *_context.getContext();
+    _builder = std::make_unique<llvm::IRBuilder<>>(context);
+    _codegen = std::make_unique<Codegen>(&context, _builder.get());
+    _codegen->set_fast_math(_options.fast_math);
+    _codegen->set_redefinable(_options.redefinable);
+    _codegen->set_math_intrinsics(_options.math_intrinsics);
+
+    if (_options.memoize)
+      _codegen->set_memoization(&_purity, _options.memo_entries);
+
+    // In the tiered mode the JIT optimizes hot functions itself
+    _optimizer = std::make_unique<Optimizer>(
+        _options.tiered ? 0 : _options.level,
+        llvm::cantFail(_jit->create_target_machine()),
+        _statistics);
+    _inline_library = std::make_unique<InlineLibrary>(context);
+    _interpreter = std::make_unique<Interpreter>(
+        [this](AST::Symbol name, int args_size) {
+          return resolve(name, args_size);
+        },
+        _options.interpret_limit);
+
+    new_module();
+  }
+
+  REPL(const REPL &) = delete;
+
+  ~REPL() {
+    if (_owned_jit)
+      return;
+
+    for (auto key : _keys)
+      log_error(_jit->remove_module(key));
   }
 
+  // Reads and handles items until the end of the input.
   void loop() {
     int await = 1;
 
     while (true) {
       if (await) {
-        fprintf(stdout, "ready> ");
+        fprintf(_output, "ready> ");
+        fflush(_output);
         _parser->lexer()->consume_token();
         await = 0;
       }
 
       switch (_parser->lexer()->current_token()) {
       case Lexer::Token::Eof:
-        exit(1); // EOF!
+        print_statistics();
+        return;
       case Lexer::Token::Newline:
         await = 1;
         _parser->lexer()->reset();
@@ -72,16 +155,63 @@ public:
         handle_top_level_expression();
         break;
       }
+
+      // The nodes of the handled item are no longer needed
+      _parser->arena()->reset();
     }
   }
 
 private:
   void handle_def() {
-    if (auto node = _parser->parse_function_definition()) {
-      if (auto *ir = _codegen->gen(node.get())) {
-        fprintf(stdout, "Read function definition:");
-        ir->print(llvm::outs());
-        fprintf(stdout, "\n");
+    if (auto node = _frontend.parse(&Parser::parse_function_definition)) {
+      _frontend.count(node, /* definition = */ true);
+
+      if (_machine) {
+        const VM::Function *function;
+
+        {
+          Statistics::Timer timer(_statistics, Statistics::Phase::Codegen);
+          function = _machine->define(node);
+        }
+
+        if (function) {
+          fprintf(_output, "Read function definition: ");
+          function->print(_output);
+        }
+
+        return;
+      }
+
+      // Rejected before the function's purity is known to its callers
+      if (!_codegen->definable(node->prototype()))
+        return;
+
+      if (_options.memoize)
+        _purity.check(node);
+
+      if (auto *ir = _frontend.gen(*_codegen, node)) {
+        optimize();
+        print("Read function definition:", ir);
+
+        // The bodies of redefinable functions must not be inlined. Others are
+        // only kept once the JIT has accepted them, from a copy, as the JIT
+        // takes the module
+        unique_ptr<llvm::Module> inlinable;
+
+        if (!_options.redefinable)
+          inlinable = llvm::CloneModule(*_module);
+
+        if (auto key = add_module(/* eager = */ false)) {
+          _keys.push_back(*key);
+
+          if (inlinable)
+            _inline_library->add(*inlinable);
+        } else {
+          log_error(key.takeError());
+          _codegen->undefine(node->prototype()->name());
+        }
+
+        new_module();
       }
     } else {
       // That's a error, skip one token
@@ -90,11 +220,16 @@ private:
   }
 
   void handle_extern() {
-    if (auto node = _parser->parse_extern()) {
-      if (auto *ir = _codegen->gen(node.get())) {
-        fprintf(stdout, "Read extern:");
-        ir->print(llvm::outs());
-        fprintf(stdout, "\n");
+    if (auto node = _frontend.parse(&Parser::parse_extern)) {
+      if (_machine) {
+        if (_machine->declare(node))
+          fprintf(_output, "Read extern: %s\n", node->name().str().c_str());
+
+        return;
+      }
+
+      if (auto *ir = _codegen->gen(node)) {
+        print("Read extern:", ir);
       }
     } else {
       // That's a error, skip one token
@@ -103,11 +238,52 @@ private:
   }
 
   void handle_top_level_expression() {
-    if (auto node = _parser->parse_top_level_expression()) {
-      if (auto *ir = _codegen->gen(node.get())) {
-        fprintf(stdout, "Read top-level expression:");
-        ir->print(llvm::outs());
-        fprintf(stdout, "\n");
+    if (auto node = _frontend.parse(&Parser::parse_top_level_expression)) {
+      _frontend.count(node, /* definition = */ false);
+
+      if (_machine) {
+        optional<double> value;
+
+        {
+          // Bytecode is compiled in a single pass while being run
+          Statistics::Timer timer(_statistics, Statistics::Phase::Execution);
+          value = _machine->evaluate(node);
+        }
+
+        if (value)
+          fprintf(_output, "Evaluated to %f\n", *value);
+
+        return;
+      }
+
+      // Small expressions are interpreted, without compiling anything
+      optional<double> value;
+
+      {
+        Statistics::Timer timer(_statistics, Statistics::Phase::Execution);
+        value = _interpreter->evaluate(node->body());
+      }
+
+      if (value) {
+        fprintf(_output, "Evaluated to %f\n", *value);
+        return;
+      }
+
+      if (auto *ir = _frontend.gen(*_codegen, node)) {
+        optimize();
+
+        print("Read top-level expression:", ir);
+
+        // The expression is compiled in a module of its own,
+        // which is removed as soon as it has been evaluated
+        auto key = add_module(/* eager = */ true);
+        new_module();
+
+        if (!key)
+          return log_error(key.takeError());
+
+        evaluate("__anon_expr");
+        log_error(_jit->remove_module(*key));
       }
     } else {
       // That's a error, skip one token
@@ -115,5 +291,128 @@ private:
     }
   }
 
-  static void new_module() {}
+  // Calls the compiled function with no arguments and prints its result.
+  void evaluate(llvm::StringRef name) {
+    auto symbol = [&]() {
+      Statistics::Timer timer(_statistics, Statistics::Phase::Materialization);
+      return _jit->lookup(name, _dylib);
+    }();
+
+    if (!symbol)
+      return log_error(symbol.takeError());
+
+    auto *function = (double (*)())(intptr_t)symbol->getAddress();
+    double value;
+
+    {
+      Statistics::Timer timer(_statistics, Statistics::Phase::Execution);
+      value = function();
+    }
+
+    fprintf(_output, "Evaluated to %f\n", value);
+  }
+
+  // Hands the current module to the JIT, into the session's dylib.
+  llvm::Expected<llvm::orc::VModuleKey> add_module(bool eager) {
+    return _jit->add_module(
+        llvm::orc::ThreadSafeModule(move(_module), _context), eager, _dylib);
+  }
+
+  void print(const char *title, llvm::Value *ir) {
+    string text;
+    llvm::raw_string_ostream stream(text);
+    ir->print(stream);
+
+    fprintf(_output, "%s%s\n", title, stream.str().c_str());
+  }
+
+  // Returns the address of the compiled function for the interpreter to call,
+  // or 0 if there is none with the name and number of arguments.
+  uint64_t resolve(AST::Symbol name, int args_size) {
+    auto *prototype = _codegen->prototype(name);
+
+    if (!prototype || prototype->args_size() != args_size)
+      return 0;
+
+    auto symbol = _jit->lookup(name.str(), _dylib);
+
+    if (!symbol) {
+      llvm::consumeError(symbol.takeError());
+      return 0;
+    }
+
+    return symbol->getAddress();
+  }
+
+  // Starts a new module for the next top-level item. A module is compiled
+  // once it is handed to the JIT, so every item gets a module of its own.
+  void new_module() {
+    _module = std::make_unique<llvm::Module>("REPL", *_context.getContext());
+    _module->setDataLayout(_jit->data_layout());
+
+    _codegen->set_module(_module.get());
+  }
+
+  // Optimizes the current module, letting the optimizer inline small
+  // functions defined in earlier modules. In the tiered mode the imported
+  // bodies are kept for the JIT to inline once it recompiles hot functions;
+  // they are not compiled otherwise. Functions which may be redefined are
+  // always called through their stubs.
+  void optimize() {
+    if ((_optimizer->level() > 0 || _options.tiered) && !_options.redefinable)
+      _inline_library->import_into(*_module);
+
+    _optimizer->optimize(*_module);
+
+    if (!_options.tiered)
+      InlineLibrary::strip(*_module);
+  }
+
+  void print_statistics() {
+    if (_statistics) {
+      _statistics->print(Diagnostics::output);
+
+      if (_options.stats_json)
+        _statistics->write_json(_options.stats_json);
+    }
+
+    if (!_jit)
+      return;
+
+    if (_options.lazy)
+      fprintf(
+          Diagnostics::output,
+          "Materialized %zu function(s)\n",
+          _jit->materialized_functions());
+
+    if (_options.tiered)
+      fprintf(
+          Diagnostics::output,
+          "Recompiled %zu hot function(s)\n",
+          _jit->promoted_functions());
+
+    if (auto *cache = _jit->object_cache())
+      fprintf(
+          Diagnostics::output,
+          "Object cache: %zu hit(s), %zu miss(es)\n",
+          cache->hits(),
+          cache->misses());
+
+    if (_options.memoize)
+      Memoizer::print(
+          Diagnostics::output, _purity.definitions(), [this](const string &name) {
+            return _jit->address_of(name, _dylib);
+          });
+
+    if (_statistics)
+      _jit->memory_pool().print(Diagnostics::output);
+  }
+
+  static void log_error(llvm::Error error) {
+    if (error)
+      fprintf(
+          Diagnostics::output,
+          "JIT error: %s\n",
+          llvm::toString(move(error)).c_str());
+  }
 };
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "llvm/Support/Error.h"
+
+#include "./diagnostics.cpp"
+#include "./jit.cpp"
+#include "./lexer.cpp"
+#include "./options.cpp"
+#include "./parser.cpp"
+#include "./repl.cpp"
+#include "./statistics.cpp"
+
+using namespace std;
+
+// Serves REPL sessions on a local UNIX socket, every connection being a
+// session of its own, run on a thread of its own. The sessions share a
+// single JIT, and so the target, the compiler and the object cache, while
+// each adds its modules to a dylib of its own and generates them in a
+// context of its own: sessions neither see each other's functions nor
+// wait for each other to parse or compile.
+class Server {
+  Options _options;
+
+  // Only set if statistics are collected, for all the sessions.
+  Statistics *_statistics;
+
+  // Not set with the VM engine, whose sessions have their own machines.
+  unique_ptr<JIT> _jit;
+
+  // A session being served, until it has ended and its thread is joined.
+  struct Session {
+    thread worker;
+    int connection;
+    bool ended = false;
+  };
+
+  // The sessions by their numbers, which name their dylibs. Ended sessions
+  // are joined as the next connection is accepted.
+  map<uint64_t, Session> _sessions;
+  uint64_t _next_session = 1;
+  mutex _sessions_mutex;
+
+public:
+  Server(const Options &options, Statistics *statistics = nullptr) :
+      _options(options), _statistics(statistics) {
+    if (_options.engine == Options::Engine::LLVM)
+      _jit = llvm::cantFail(JIT::Create(_options, _statistics));
+  }
+
+  // Listens on the socket, replacing any file at its path, and serves
+  // connections until an error occurs, then ends the sessions being served.
+  // Returns the process exit code.
+  int run(const char *path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+      fprintf(stderr, "Error: the socket path %s is too long\n", path);
+      return 1;
+    }
+
+    strcpy(address.sun_path, path);
+
+    // A client closing its connection must not end the server
+    signal(SIGPIPE, SIG_IGN);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (listener < 0)
+      return log_error("socket");
+
+    unlink(path);
+
+    if (bind(listener, (sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(listener, SOMAXCONN) < 0) {
+      close(listener);
+      return log_error(path);
+    }
+
+    while (true) {
+      int connection = accept(listener, nullptr, nullptr);
+
+      if (connection < 0) {
+        if (errno == EINTR || errno == ECONNABORTED)
+          continue;
+
+        close(listener);
+        log_error("accept");
+        stop();
+        return 1;
+      }
+
+      join_ended();
+
+      lock_guard<mutex> lock(_sessions_mutex);
+      auto number = _next_session++;
+      _sessions[number] = {thread(&Server::serve, this, number, connection), connection};
+    }
+  }
+
+private:
+  void serve(uint64_t number, int connection) {
+    int output_descriptor = dup(connection);
+    FILE *input = fdopen(connection, "r");
+    FILE *output = output_descriptor < 0 ? nullptr : fdopen(output_descriptor, "w");
+
+    if (!input || !output) {
+      log_error("fdopen");
+      end(number);
+
+      if (input)
+        fclose(input);
+      else
+        close(connection);
+
+      if (output)
+        fclose(output);
+      else if (output_descriptor >= 0)
+        close(output_descriptor);
+
+      return;
+    }
+
+    Diagnostics::output = output;
+
+    {
+      Lexer lexer(input);
+      lexer.set_statistics(_statistics);
+      Parser parser(&lexer);
+      llvm::orc::JITDylib *dylib = nullptr;
+
+      if (_jit)
+        dylib = &_jit->create_dylib("session." + to_string(number));
+
+      REPL repl(&parser, _options, _statistics, output, _jit.get(), dylib);
+      repl.loop();
+    }
+
+    end(number);
+    fclose(input);
+    fclose(output);
+  }
+
+  // Marks the session ended, before its connection is closed, so that the
+  // server does not shut down another connection given the same descriptor.
+  void end(uint64_t number) {
+    lock_guard<mutex> lock(_sessions_mutex);
+
+    auto session = _sessions.find(number);
+    if (session != _sessions.end())
+      session->second.ended = true;
+  }
+
+  // Joins the threads of the sessions which have ended.
+  void join_ended() {
+    lock_guard<mutex> lock(_sessions_mutex);
+
+    for (auto session = _sessions.begin(); session != _sessions.end();) {
+      if (!session->second.ended) {
+        session++;
+        continue;
+      }
+
+      session->second.worker.join();
+      session = _sessions.erase(session);
+    }
+  }
+
+  // Ends every session, shutting its connection down so that it reads the
+  // end of its input, and waits for them, as they use the JIT. A session
+  // running a function only ends once the function returns.
+  void stop() {
+    map<uint64_t, Session> sessions;
+
+    {
+      lock_guard<mutex> lock(_sessions_mutex);
+
+      for (auto &session : _sessions)
+        if (!session.second.ended)
+          shutdown(session.second.connection, SHUT_RDWR);
+
+      sessions.swap(_sessions);
+    }
+
+    for (auto &session : sessions)
+      session.second.worker.join();
+  }
+
+  static int log_error(const char *what) {
+    fprintf(stderr, "Error: %s: %s\n", what, strerror(errno));
+    return 1;
+  }
+};
@@ -0,0 +1,239 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/Any.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/PassInstrumentation.h"
+
+using namespace std;
+
+// Times the phases of the compiler and counts what they process,
+// to be reported once the session ends.
+//
+// Times are exclusive: a phase timed while another one is being timed on the
+// same thread, e.g. lexing while parsing, is not counted as the outer
+// phase's time. The same goes for passes run by other passes.
+class Statistics {
+public:
+  using Clock = chrono::steady_clock;
+
+  enum class Phase {
+    Lex,
+    Parse,
+    Codegen,
+    Optimization,
+    Materialization, // Compiling IR into objects and linking them
+    Execution,
+  };
+
+  enum class Counter {
+    Tokens,
+    Nodes,
+    Functions,
+    InstructionsBefore, // IR instructions, before optimization
+    InstructionsAfter,  // ditto, after
+    CodeBytes,          // Bytes of code sections emitted
+  };
+
+  // Times the phase for as long as it lives. Does nothing without statistics.
+  class Timer {
+    Statistics *_statistics;
+    Phase _phase;
+    Clock::time_point _start;
+    uint64_t _nested = 0;
+    Timer *_outer = nullptr;
+
+    // The innermost timer of the thread.
+    inline static thread_local Timer *_current = nullptr;
+
+  public:
+    Timer(Statistics *statistics, Phase phase) :
+        _statistics(statistics), _phase(phase) {
+      if (!_statistics)
+        return;
+
+      _outer = _current;
+      _current = this;
+      _start = Clock::now();
+    }
+
+    Timer(const Timer &) = delete;
+
+    ~Timer() {
+      if (!_statistics)
+        return;
+
+      auto elapsed = since(_start);
+      _statistics->_nanoseconds[(int)_phase] += elapsed - _nested;
+
+      if (_outer)
+        _outer->_nested += elapsed;
+
+      _current = _outer;
+    }
+  };
+
+private:
+  static constexpr const char *_phase_names[] = {
+      "lex", "parse", "codegen", "optimization", "materialization", "execution"};
+
+  static constexpr const char *_counter_names[] = {
+      "tokens",
+      "nodes",
+      "functions",
+      "instructions_before_optimization",
+      "instructions_after_optimization",
+      "code_bytes"};
+
+  static constexpr int _phases = sizeof(_phase_names) / sizeof(*_phase_names);
+  static constexpr int _counters = sizeof(_counter_names) / sizeof(*_counter_names);
+
+  struct Pass {
+    uint64_t nanoseconds = 0;
+    uint64_t runs = 0;
+  };
+
+  // A pass being run, on the stack of the optimizer running it.
+  struct Run {
+    string name;
+    Clock::time_point start;
+    uint64_t nested;
+  };
+
+  atomic<uint64_t> _nanoseconds[_phases] = {};
+  atomic<uint64_t> _counts[_counters] = {};
+
+  map<string, Pass> _passes;
+  mutex _passes_mutex;
+
+public:
+  void add(Counter counter, uint64_t count) { _counts[(int)counter] += count; }
+
+  // Times every pass run with the callbacks. The callbacks must only be used
+  // by one thread at a time, e.g. by a single optimizer.
+  void time_passes(llvm::PassInstrumentationCallbacks &callbacks) {
+    auto stack = std::make_shared<vector<Run>>();
+
+    callbacks.registerBeforePassCallback([stack](llvm::StringRef pass, llvm::Any) {
+      stack->push_back({pass.str(), Clock::now(), 0});
+      return true;
+    });
+
+    callbacks.registerAfterPassCallback([this, stack](llvm::StringRef, llvm::Any) {
+      if (stack->empty())
+        return;
+
+      auto run = move(stack->back());
+      stack->pop_back();
+
+      auto elapsed = since(run.start);
+
+      if (!stack->empty())
+        stack->back().nested += elapsed;
+
+      lock_guard<mutex> lock(_passes_mutex);
+      auto &pass = _passes[run.name];
+      pass.nanoseconds += elapsed - run.nested;
+      pass.runs++;
+    });
+  }
+
+  // Print a summary, with the slowest passes.
+  void print(FILE *output) {
+    fprintf(output, "Statistics:\n");
+
+    for (int i = 0; i < _phases; i++)
+      fprintf(output, "  %-24s %10.3f ms\n", _phase_names[i], _nanoseconds[i] / 1e6);
+
+    for (int i = 0; i < _counters; i++)
+      fprintf(output, "  %-34s %llu\n", _counter_names[i], (unsigned long long)_counts[i]);
+
+    auto passes = sorted_passes();
+
+    if (passes.empty())
+      return;
+
+    fprintf(output, "  Slowest passes:\n");
+
+    for (size_t i = 0; i < passes.size() && i < 10; i++)
+      fprintf(
+          output,
+          "    %-40s %10.3f ms in %llu run(s)\n",
+          passes[i].first.c_str(),
+          passes[i].second.nanoseconds / 1e6,
+          (unsigned long long)passes[i].second.runs);
+  }
+
+  // Write everything as JSON. Returns false if the file cannot be written.
+  bool write_json(const char *path) {
+    auto *output = fopen(path, "w");
+
+    if (!output) {
+      fprintf(stderr, "Error: cannot write %s\n", path);
+      return false;
+    }
+
+    fprintf(output, "{\"phases_ms\": {");
+
+    for (int i = 0; i < _phases; i++)
+      fprintf(
+          output, "%s\"%s\": %.6f", i ? ", " : "", _phase_names[i], _nanoseconds[i] / 1e6);
+
+    fprintf(output, "}, \"counters\": {");
+
+    for (int i = 0; i < _counters; i++)
+      fprintf(
+          output,
+          "%s\"%s\": %llu",
+          i ? ", " : "",
+          _counter_names[i],
+          (unsigned long long)_counts[i]);
+
+    fprintf(output, "}, \"passes\": [");
+
+    auto passes = sorted_passes();
+
+    for (size_t i = 0; i < passes.size(); i++) {
+      fprintf(output, "%s\n  {\"name\": \"", i ? "," : "");
+
+      // Escape quotes and backslashes, should a pass name contain any
+      for (char c : passes[i].first)
+        fprintf(output, c == '"' || c == '\\' ? "\\%c" : "%c", c);
+
+      fprintf(
+          output,
+          "\", \"ms\": %.6f, \"runs\": %llu}",
+          passes[i].second.nanoseconds / 1e6,
+          (unsigned long long)passes[i].second.runs);
+    }
+
+    fprintf(output, "\n]}\n");
+    return fclose(output) == 0;
+  }
+
+private:
+  vector<pair<string, Pass>> sorted_passes() {
+    lock_guard<mutex> lock(_passes_mutex);
+    vector<pair<string, Pass>> passes(_passes.begin(), _passes.end());
+
+    sort(passes.begin(), passes.end(), [](auto &a, auto &b) {
+      return a.second.nanoseconds > b.second.nanoseconds;
+    });
+
+    return passes;
+  }
+
+  static uint64_t since(Clock::time_point start) {
+    return chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+  }
+};
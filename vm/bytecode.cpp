@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "../ast/symbol.cpp"
+
+using namespace std;
+
+namespace VM {
+// Operations of the register machine. Operands are register indices unless
+// noted otherwise.
+enum class Op : uint16_t {
+  Constant,   // a = constants[b]
+  Move,       // a = b
+  Add,        // a = b + c
+  Subtract,   // a = b - c
+  Multiply,   // a = b * c
+  Less,       // a = b < c ? 1 : 0, true if either is NaN
+  Call,       // a = functions[b](c, c + 1, ...)
+  Return,     // Return a
+  Jump,       // Continue at instruction b
+  JumpUnless, // Continue at instruction b if a is 0 or NaN
+};
+
+struct Instruction {
+  Op op;
+  uint16_t a, b, c;
+};
+
+static_assert(sizeof(Instruction) == 8, "Instructions are kept compact");
+
+// A function of the machine: either compiled to bytecode or native.
+// Arguments are passed in the first registers of the callee's frame.
+struct Function {
+  AST::Symbol name;
+  int arity;
+
+  // Set if defined in the language.
+  vector<Instruction> code;
+  vector<double> constants;
+  uint16_t registers = 0; // The frame size, arguments included
+
+  // Set if declared as extern: the address of the native function.
+  uint64_t native = 0;
+
+  Function(AST::Symbol name, int arity) : name(name), arity(arity) {}
+
+  bool defined() const { return !code.empty(); }
+
+  // Prints the bytecode, for inspection.
+  void print(FILE *output) const {
+    static const char *names[] = {
+        "constant",
+        "move",
+        "add",
+        "subtract",
+        "multiply",
+        "less",
+        "call",
+        "return",
+        "jump",
+        "unless"};
+
+    fprintf(output, "%s/%d, %u register(s):\n", name.str().c_str(), arity, registers);
+
+    for (size_t i = 0; i < code.size(); i++) {
+      auto &instruction = code[i];
+
+      if (instruction.op == Op::Jump) {
+        fprintf(output, "  %4zu %-8s @%u\n", i, names[(int)instruction.op], instruction.b);
+        continue;
+      }
+
+      fprintf(output, "  %4zu %-8s r%u", i, names[(int)instruction.op], instruction.a);
+
+      switch (instruction.op) {
+      case Op::Constant:
+        fprintf(output, ", %g\n", constants[instruction.b]);
+        break;
+      case Op::Move:
+        fprintf(output, ", r%u\n", instruction.b);
+        break;
+      case Op::Call:
+        fprintf(output, ", #%u, r%u\n", instruction.b, instruction.c);
+        break;
+      case Op::JumpUnless:
+        fprintf(output, ", @%u\n", instruction.b);
+        break;
+      case Op::Return:
+        fprintf(output, "\n");
+        break;
+      default:
+        fprintf(output, ", r%u, r%u\n", instruction.b, instruction.c);
+        break;
+      }
+    }
+  }
+};
+} // namespace VM
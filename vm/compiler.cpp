@@ -0,0 +1,311 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "../ast/expression/binary.cpp"
+#include "../ast/expression/call.cpp"
+#include "../ast/expression/for.cpp"
+#include "../ast/expression/if.cpp"
+#include "../ast/expression/number.cpp"
+#include "../ast/expression/variable.cpp"
+#include "../ast/expression/visitor.cpp"
+#include "../ast/function.cpp"
+#include "../ast/symbol.cpp"
+#include "../diagnostics.cpp"
+#include "../native.cpp"
+#include "./bytecode.cpp"
+
+using namespace std;
+
+namespace VM {
+// Compiles functions into bytecode. The arguments are in the first registers
+// of a frame, followed by loop variables and temporaries, which are allocated
+// and freed as a stack. A call's arguments are put in consecutive registers at the top of
+// the caller's frame, where the callee's frame then starts.
+class Compiler : public AST::Expression::Visitor<Compiler, bool> {
+  const vector<unique_ptr<Function>> &_functions;
+  const unordered_map<AST::Symbol, uint16_t> &_indices;
+
+  Function *_function = nullptr;
+
+  // The registers of the arguments and of the loop variables in scope.
+  unordered_map<AST::Symbol, uint16_t> _variables;
+
+  // The register the expression being visited is computed into.
+  uint16_t _target = 0;
+
+  // The first free register.
+  uint32_t _top = 0;
+
+public:
+  static bool log_error(const char *string) {
+    fprintf(Diagnostics::output, "VM error: %s\n", string);
+    return false;
+  }
+
+  // Callees are looked up in the functions, by their indices.
+  Compiler(
+      const vector<unique_ptr<Function>> &functions,
+      const unordered_map<AST::Symbol, uint16_t> &indices) :
+      _functions(functions), _indices(indices) {}
+
+  // Compile the node into the function. Returns false on error.
+  bool compile(AST::Function *node, Function &function) {
+    auto *prototype = node->prototype();
+
+    _function = &function;
+    _function->code.clear();
+    _function->constants.clear();
+    _variables.clear();
+
+    for (int i = 0; i < prototype->args_size(); i++)
+      _variables[prototype->arg(i)] = i;
+
+    _top = prototype->args_size();
+    _function->registers = _top;
+
+    auto result = allocate();
+
+    if (!result || !into(node->body(), *result))
+      return false;
+
+    emit(Op::Return, *result);
+
+    if (_function->code.size() > UINT16_MAX)
+      return log_error("Function too large");
+
+    return true;
+  }
+
+  using Visitor::visit;
+
+  bool visit(AST::Expression::Number *node) { return constant(_target, node->value()); }
+
+  bool visit(AST::Expression::Variable *node) {
+    auto argument = _variables.find(node->name());
+
+    if (argument == _variables.end())
+      return log_error("Unknown variable name");
+
+    emit(Op::Move, _target, argument->second);
+    return true;
+  }
+
+  bool visit(AST::Expression::Binary *node) {
+    auto target = _target;
+    auto top = _top;
+    Op op;
+
+    switch (node->op()) {
+    case '+':
+      op = Op::Add;
+      break;
+    case '-':
+      op = Op::Subtract;
+      break;
+    case '*':
+      op = Op::Multiply;
+      break;
+    case '<':
+      op = Op::Less;
+      break;
+    default:
+      return log_error("Invalid binary operator");
+    }
+
+    auto lhs = operand(node->lhs());
+    if (!lhs)
+      return false;
+
+    auto rhs = operand(node->rhs());
+    if (!rhs)
+      return false;
+
+    emit(op, target, *lhs, *rhs);
+    _top = top;
+    return true;
+  }
+
+  bool visit(AST::Expression::Call *node) {
+    auto target = _target;
+    auto index = _indices.find(node->callee());
+
+    if (index == _indices.end())
+      return log_error("Unknown function referenced");
+
+    auto &callee = *_functions[index->second];
+
+    if (callee.arity != node->args_size())
+      return log_error("Incorrect number of arguments");
+
+    if (callee.native && callee.arity > Native::max_args)
+      return log_error("Too many arguments for a native call");
+
+    // Allocate all the argument registers first, so that they are consecutive
+    auto base = _top;
+
+    for (int i = 0; i < node->args_size(); i++)
+      if (!allocate())
+        return false;
+
+    for (int i = 0; i < node->args_size(); i++)
+      if (!into(node->arg(i), base + i))
+        return false;
+
+    // The callee's frame starts at its arguments
+    emit(Op::Call, target, index->second, base);
+    _top = base;
+    return true;
+  }
+
+  bool visit(AST::Expression::If *node) {
+    auto target = _target;
+    auto top = _top;
+
+    auto condition = operand(node->condition());
+    if (!condition)
+      return false;
+
+    _top = top;
+    auto unless = emit(Op::JumpUnless, *condition);
+
+    if (!into(node->then(), target))
+      return false;
+
+    auto jump = emit(Op::Jump, 0);
+    patch(unless);
+
+    if (!into(node->otherwise(), target))
+      return false;
+
+    patch(jump);
+    return true;
+  }
+
+  bool visit(AST::Expression::For *node) {
+    auto target = _target;
+    auto top = _top;
+
+    auto variable = allocate();
+    if (!variable || !into(node->start(), *variable))
+      return false;
+
+    // The variable shadows an argument of the same name within the loop
+    auto shadowed = _variables.find(node->variable());
+    optional<uint16_t> shadowed_register;
+
+    if (shadowed != _variables.end())
+      shadowed_register = shadowed->second;
+
+    _variables[node->variable()] = *variable;
+
+    auto header = _function->code.size();
+    auto loop_top = _top;
+
+    auto condition = operand(node->end());
+    if (!condition)
+      return false;
+
+    _top = loop_top;
+    auto unless = emit(Op::JumpUnless, *condition);
+
+    // The body's value is discarded
+    auto scratch = allocate();
+    if (!scratch || !into(node->body(), *scratch))
+      return false;
+
+    _top = loop_top;
+
+    if (node->step()) {
+      auto step = operand(node->step());
+      if (!step)
+        return false;
+
+      emit(Op::Add, *variable, *variable, *step);
+    } else {
+      auto step = allocate();
+      if (!step || !constant(*step, 1))
+        return false;
+
+      emit(Op::Add, *variable, *variable, *step);
+    }
+
+    _top = loop_top;
+    emit(Op::Jump, 0, header);
+    patch(unless);
+
+    if (shadowed_register)
+      _variables[node->variable()] = *shadowed_register;
+    else
+      _variables.erase(node->variable());
+
+    _top = top;
+    return constant(target, 0);
+  }
+
+private:
+  bool into(AST::Expression::Base *node, uint16_t target) {
+    _target = target;
+    return visit(node);
+  }
+
+  // Returns the register holding the node's value: the argument's own one
+  // for a variable, a new temporary otherwise.
+  optional<uint16_t> operand(AST::Expression::Base *node) {
+    if (node->kind() == AST::Expression::Base::Kind::Variable) {
+      auto argument = _variables.find(static_cast<AST::Expression::Variable *>(node)->name());
+
+      if (argument == _variables.end()) {
+        log_error("Unknown variable name");
+        return nullopt;
+      }
+
+      return argument->second;
+    }
+
+    auto target = allocate();
+
+    if (!target || !into(node, *target))
+      return nullopt;
+
+    return target;
+  }
+
+  optional<uint16_t> allocate() {
+    if (_top >= UINT16_MAX) {
+      log_error("Too many registers");
+      return nullopt;
+    }
+
+    uint16_t target = _top++;
+
+    if (_top > _function->registers)
+      _function->registers = _top;
+
+    return target;
+  }
+
+  bool constant(uint16_t target, double value) {
+    if (_function->constants.size() > UINT16_MAX)
+      return log_error("Too many constants");
+
+    emit(Op::Constant, target, _function->constants.size());
+    _function->constants.push_back(value);
+    return true;
+  }
+
+  // Emits the instruction, returning its index.
+  size_t emit(Op op, uint16_t a, uint16_t b = 0, uint16_t c = 0) {
+    _function->code.push_back({op, a, b, c});
+    return _function->code.size() - 1;
+  }
+
+  // Makes the jump at the index continue at the next instruction.
+  void patch(size_t jump) { _function->code[jump].b = _function->code.size(); }
+};
+} // namespace VM
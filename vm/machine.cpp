@@ -0,0 +1,246 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "llvm/Support/DynamicLibrary.h"
+
+#include "../ast/function.cpp"
+#include "../ast/prototype.cpp"
+#include "../native.cpp"
+#include "./bytecode.cpp"
+#include "./compiler.cpp"
+
+using namespace std;
+
+namespace VM {
+// Runs functions compiled to bytecode, an engine which starts instantly and
+// needs little memory, at the cost of peak throughput.
+//
+// Dispatch is threaded: every handler jumps straight to the handler of the
+// next instruction through a table of label addresses, a GCC and Clang
+// extension, rather than going back to a switch.
+class Machine {
+  vector<unique_ptr<Function>> _functions;
+  unordered_map<AST::Symbol, uint16_t> _indices;
+  Compiler _compiler;
+
+  // Whether functions may be defined again. Calls refer to functions by
+  // their indices, so a new definition replaces the code at the same index.
+  bool _redefinable;
+
+  // The frames of the running functions. Every frame starts at the argument
+  // registers of the call which made it.
+  vector<double> _stack;
+
+public:
+  Machine(bool redefinable = false) :
+      _compiler(_functions, _indices), _redefinable(redefinable), _stack(1024) {
+    // Make the process' own symbols available to externs
+    llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+  }
+
+  Machine(const Machine &) = delete;
+
+  // Compile the definition. Returns the function, or nullptr on error.
+  const Function *define(AST::Function *node) {
+    auto *prototype = node->prototype();
+    auto index = _indices.find(prototype->name());
+
+    if (index != _indices.end())
+      return redefine(*_functions[index->second], node);
+
+    auto *function = add(prototype);
+
+    if (!function)
+      return nullptr;
+
+    // The function is added first, so that it may call itself
+    if (!_compiler.compile(node, *function)) {
+      _indices.erase(prototype->name());
+      _functions.pop_back();
+      return nullptr;
+    }
+
+    return function;
+  }
+
+  // Declare the native function. Returns it, or nullptr on error.
+  const Function *declare(AST::Prototype *node) {
+    auto index = _indices.find(node->name());
+
+    if (index != _indices.end()) {
+      auto *function = _functions[index->second].get();
+
+      if (function->arity != node->args_size()) {
+        Compiler::log_error("Function redeclared with a different number of arguments");
+        return nullptr;
+      }
+
+      return function;
+    }
+
+    auto address = (uint64_t)llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(
+        node->name().str());
+
+    if (!address) {
+      Compiler::log_error("Cannot resolve extern");
+      return nullptr;
+    }
+
+    auto *function = add(node);
+
+    if (function)
+      function->native = address;
+
+    return function;
+  }
+
+  // Evaluate the top-level expression. Returns nothing on error.
+  optional<double> evaluate(AST::Function *node) {
+    Function function(node->prototype()->name(), 0);
+
+    if (!_compiler.compile(node, function))
+      return nullopt;
+
+    reserve(function.registers);
+    return execute(function, 0);
+  }
+
+private:
+  const Function *redefine(Function &function, AST::Function *node) {
+    if (!_redefinable || !function.defined()) {
+      Compiler::log_error("Function cannot be redefined");
+      return nullptr;
+    }
+
+    if (function.arity != node->prototype()->args_size()) {
+      Compiler::log_error("Function redefined with a different number of arguments");
+      return nullptr;
+    }
+
+    // The earlier definition is kept if the new one fails to compile
+    Function replacement(function.name, function.arity);
+
+    if (!_compiler.compile(node, replacement))
+      return nullptr;
+
+    function = move(replacement);
+    return &function;
+  }
+
+  Function *add(AST::Prototype *node) {
+    if (_functions.size() > UINT16_MAX) {
+      Compiler::log_error("Too many functions");
+      return nullptr;
+    }
+
+    _indices[node->name()] = _functions.size();
+    _functions.push_back(std::make_unique<Function>(node->name(), node->args_size()));
+
+    return _functions.back().get();
+  }
+
+  // Make the stack hold at least the number of registers.
+  void reserve(size_t size) {
+    if (size > _stack.size())
+      _stack.resize(max(size, _stack.size() * 2));
+  }
+
+  // Run the function in the frame starting at the base register.
+  double execute(const Function &function, size_t base) {
+    // In the order of the operations
+    static const void *handlers[] = {
+        &&constant,
+        &&move,
+        &&add,
+        &&subtract,
+        &&multiply,
+        &&less,
+        &&call,
+        &&ret,
+        &&jump,
+        &&jump_unless};
+
+    const Instruction *code = function.code.data();
+    const Instruction *instruction = code;
+    const double *constants = function.constants.data();
+    double *r = &_stack[base];
+
+#define DISPATCH() goto *handlers[(int)instruction->op]
+#define NEXT()                                                                 \
+  do {                                                                         \
+    instruction++;                                                             \
+    DISPATCH();                                                                \
+  } while (0)
+
+    DISPATCH();
+
+  constant:
+    r[instruction->a] = constants[instruction->b];
+    NEXT();
+
+  move:
+    r[instruction->a] = r[instruction->b];
+    NEXT();
+
+  add:
+    r[instruction->a] = r[instruction->b] + r[instruction->c];
+    NEXT();
+
+  subtract:
+    r[instruction->a] = r[instruction->b] - r[instruction->c];
+    NEXT();
+
+  multiply:
+    r[instruction->a] = r[instruction->b] * r[instruction->c];
+    NEXT();
+
+  less:
+    r[instruction->a] = !(r[instruction->b] >= r[instruction->c]) ? 1.0 : 0.0;
+    NEXT();
+
+  call: {
+    auto &callee = *_functions[instruction->b];
+    double value;
+
+    if (callee.native)
+      value = Native::call(callee.native, r + instruction->c, callee.arity);
+    else {
+      size_t callee_base = base + instruction->c;
+      reserve(callee_base + callee.registers);
+      value = execute(callee, callee_base);
+
+      // The stack may have been reallocated
+      r = &_stack[base];
+    }
+
+    r[instruction->a] = value;
+    NEXT();
+  }
+
+  ret:
+    return r[instruction->a];
+
+  jump:
+    instruction = code + instruction->b;
+    DISPATCH();
+
+  jump_unless:
+    // Neither 0 nor NaN, as the compiled conditions
+    if (r[instruction->a] < 0 || r[instruction->a] > 0)
+      NEXT();
+
+    instruction = code + instruction->b;
+    DISPATCH();
+
+#undef NEXT
+#undef DISPATCH
+  }
+};
+} // namespace VM